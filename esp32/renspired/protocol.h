@@ -0,0 +1,655 @@
+/**
+ * Renspired link protocol
+ *
+ * Shared between the Nspire program (main.c) and the ESP32 sketch, so both
+ * ends agree on framing, checksums, compression and the chunk window.
+ */
+
+#ifndef RENSPIRED_PROTOCOL_H
+#define RENSPIRED_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* ============================================================================
+ * Framing
+ * ============================================================================
+ *
+ * Everything on the link travels in frames:
+ *
+ *   [SOF][type][len][payload...][crc32 LE]
+ *
+ * The CRC covers type, len and payload. The top two bits of the type pick a
+ * channel, so control traffic, response data, debug text and progress updates
+ * share one UART. Bytes outside a frame are ignored, which lets the Nspire
+ * keep sending raw newlines to wake the ESP32 from light sleep.
+ */
+
+#define FRAME_SOF 0xA5
+#define FRAME_MAX_PAYLOAD 255
+#define FRAME_OVERHEAD 7
+#define FRAME_IDLE_MS 20 /* A quiet line ends an unfinished frame */
+
+#define FRAME_CH_CTL 0x00
+#define FRAME_CH_DATA 0x40
+#define FRAME_CH_DEBUG 0x80
+#define FRAME_CH_PROGRESS 0xC0
+#define FRAME_CHANNEL(type) ((type) & 0xC0)
+
+/* Control */
+#define F_HELLO (FRAME_CH_CTL | 0x01) /* ESP32 is up, repeated until SYNC */
+#define F_AWAKE (FRAME_CH_CTL | 0x02) /* ESP32 woke from light sleep */
+#define F_RST (FRAME_CH_CTL | 0x03)
+#define F_SYNC (FRAME_CH_CTL | 0x04)
+#define F_READY (FRAME_CH_CTL | 0x05)     /* u32 session ID */
+#define F_BAUD (FRAME_CH_CTL | 0x06)      /* u32 rate */
+#define F_BAUD_OK (FRAME_CH_CTL | 0x07)   /* Both sides switch after this */
+#define F_BAUD_NO (FRAME_CH_CTL | 0x08)   /* Rate refused */
+#define F_BAUD_TEST (FRAME_CH_CTL | 0x09) /* LINK_BAUD_TEST at the new rate */
+#define F_CAPS (FRAME_CH_CTL | 0x0A)      /* u8 CAP_* bits */
+#define F_ERR (FRAME_CH_CTL | 0x0B)       /* Error code text, ends a request */
+#define F_RESP (FRAME_CH_CTL | 0x0C)      /* u32 length, 0 if streamed + ID */
+#define F_ACK (FRAME_CH_CTL | 0x0D)       /* ID + u8 seq, covers all before */
+#define F_NAK (FRAME_CH_CTL | 0x0E)       /* ID + u8 seq to resend */
+#define F_CANCEL (FRAME_CH_CTL | 0x0F)    /* Drop request, echoed when done */
+#define F_STATUS (FRAME_CH_CTL | 0x10)    /* Health check, u8 STATUS_* back */
+
+/* The ID is the u8 request ID the Nspire sent with F_REQ_END. Everything
+ * about the reply carries it, so a resend from an earlier reply can never be
+ * taken for part of this one. */
+
+/* Data */
+#define F_CHUNK (FRAME_CH_DATA | 0x01)   /* ID + u8 seq + reply, empty = end */
+#define F_REQ (FRAME_CH_DATA | 0x02)     /* u8 seq + request bytes */
+#define F_REQ_END (FRAME_CH_DATA | 0x03) /* Request complete, u8 ID */
+
+/* Debug */
+#define F_LOG (FRAME_CH_DEBUG | 0x01) /* Text for the other side's log */
+
+/* Progress */
+#define F_PROGRESS (FRAME_CH_PROGRESS | 0x01) /* u8 PROGRESS_* stage */
+
+#define PROGRESS_CONNECTING 1 /* Opening the API connection */
+#define PROGRESS_WAITING 2    /* Request sent, waiting for the model */
+#define PROGRESS_GENERATING 3 /* Model is producing output */
+
+#define CAP_LZ 0x01   /* Responses LZ compressed */
+#define CAP_LZUP 0x02 /* Requests LZ compressed */
+
+#define STATUS_WIFI 0x01 /* Associated, ready for requests */
+
+/* Confirmed byte for byte before a negotiated baud rate is kept. 'U' and '*'
+ * are alternating bit patterns, which are the first to break at a bad rate. */
+#define LINK_BAUD_TEST "UUUU****0f0f~~~~ZaZa"
+
+/* Response data is sent as F_CHUNK frames through a window of LINK_WINDOW
+ * chunks, see "Chunk window" below. tests/ builds with other sizes to
+ * measure them. */
+#ifndef LINK_CHUNK_SIZE
+#define LINK_CHUNK_SIZE 128 /* Up to FRAME_MAX_PAYLOAD - 2, after ID + seq */
+#endif
+#ifndef LINK_WINDOW
+#define LINK_WINDOW 8 /* Chunks in flight, a power of two up to 128 */
+#endif
+#define LINK_RETRANSMIT_MS 500 /* Resend the oldest if nothing moves */
+#define LINK_MAX_RETRIES 10    /* Resends in a row before giving up */
+
+/* ============================================================================
+ * CRC32 (IEEE 802.3, reflected)
+ * ============================================================================
+ */
+
+#define CRC32_INIT 0xFFFFFFFFu
+
+static inline uint32_t crc32_update(uint32_t crc, const uint8_t *data,
+                                    int len) {
+  /* Nibble table, 64 bytes instead of 1 KB and plenty fast for 64 byte
+   * chunks */
+  static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4,
+      0x4DB26158, 0x5005713C, 0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+      0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+  while (len-- > 0) {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return crc;
+}
+
+static inline uint32_t crc32_final(uint32_t crc) { return crc ^ 0xFFFFFFFFu; }
+
+/* ============================================================================
+ * Frame encoder and parser
+ * ============================================================================
+ */
+
+enum { FRAME_NONE, FRAME_OK, FRAME_BAD };
+
+typedef struct {
+  uint8_t state;
+  uint8_t type;
+  uint8_t len;
+  uint8_t pos;
+  uint32_t crc;
+  uint8_t payload[FRAME_MAX_PAYLOAD];
+  /* Bytes still to be looked at again after a bad frame, see frame_parse() */
+  uint8_t replay[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+  int replay_pos, replay_len;
+} FrameParser;
+
+/* One entry per frame type a side understands */
+typedef struct {
+  uint8_t type;
+  void (*handler)(const uint8_t *payload, int len);
+} FrameHandler;
+
+static inline uint32_t frame_get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void frame_put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* Build a frame in out, which needs len + FRAME_OVERHEAD bytes. Returns the
+ * frame size. */
+static inline int frame_encode(uint8_t *out, uint8_t type, const void *payload,
+                               int len) {
+  out[0] = FRAME_SOF;
+  out[1] = type;
+  out[2] = len;
+  if (len > 0)
+    memcpy(out + 3, payload, len);
+
+  uint32_t crc = crc32_final(crc32_update(CRC32_INIT, out + 1, len + 2));
+  for (int i = 0; i < 4; i++)
+    out[3 + len + i] = crc >> (8 * i);
+  return len + FRAME_OVERHEAD;
+}
+
+static inline void frame_parser_init(FrameParser *p) {
+  p->state = 0;
+  p->replay_pos = p->replay_len = 0;
+}
+
+/* A frame failed its CRC, or was cut short. Its SOF may have been a payload
+ * byte, or its length damaged, in which case it swallowed the start of the
+ * next real frame. So the n bytes taken after its SOF are hunted through
+ * again, ahead of whatever was already waiting. That can never be more than
+ * a frame. */
+static inline void frame_replay_bad(FrameParser *p, int n) {
+  uint8_t taken[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+  int tail = p->replay_len - p->replay_pos;
+
+  taken[0] = p->type;
+  taken[1] = p->len;
+  memcpy(taken + 2, p->payload, p->len);
+  frame_put_u32(taken + 2 + p->len, p->crc);
+
+  memmove(p->replay + n, p->replay + p->replay_pos, tail);
+  memcpy(p->replay, taken, n);
+  p->replay_pos = 0;
+  p->replay_len = n + tail;
+}
+
+static inline int frame_parse_byte(FrameParser *p, uint8_t b) {
+  enum { HUNT, TYPE, LEN, PAYLOAD, CRC };
+
+  switch (p->state) {
+  case HUNT:
+    if (b == FRAME_SOF)
+      p->state = TYPE;
+    return FRAME_NONE;
+  case TYPE:
+    p->type = b;
+    p->state = LEN;
+    return FRAME_NONE;
+  case LEN:
+    p->len = b;
+    p->pos = 0;
+    p->crc = 0;
+    p->state = b ? PAYLOAD : CRC;
+    return FRAME_NONE;
+  case PAYLOAD:
+    p->payload[p->pos++] = b;
+    if (p->pos == p->len) {
+      p->pos = 0;
+      p->state = CRC;
+    }
+    return FRAME_NONE;
+  default:
+    p->crc |= (uint32_t)b << (8 * p->pos++);
+    if (p->pos < 4)
+      return FRAME_NONE;
+    p->state = HUNT;
+
+    {
+      uint8_t header[2] = {p->type, p->len};
+      uint32_t calc = crc32_update(CRC32_INIT, header, 2);
+      calc = crc32_final(crc32_update(calc, p->payload, p->len));
+      if (calc == p->crc)
+        return FRAME_OK;
+      frame_replay_bad(p, 2 + p->len + 4);
+      return FRAME_BAD;
+    }
+  }
+}
+
+/* Go on through bytes held back after a bad frame. Returns FRAME_NONE once
+ * there are none left, so callers check this before reading more. */
+static inline int frame_parse_pending(FrameParser *p) {
+  while (p->replay_pos < p->replay_len) {
+    int r = frame_parse_byte(p, p->replay[p->replay_pos++]);
+    if (r != FRAME_NONE)
+      return r;
+  }
+  p->replay_pos = p->replay_len = 0;
+  return FRAME_NONE;
+}
+
+/* Feed one received byte. Returns FRAME_OK once a complete frame is in p,
+ * FRAME_BAD if one failed its CRC, FRAME_NONE otherwise. After a bad frame
+ * the parser hunts for the next SOF from just after the bad one's, since a
+ * bad length can hide the real start of the next frame inside it. Those
+ * bytes are held back and go through first, one frame per call, which is
+ * why frame_parse_pending() exists. */
+static inline int frame_parse(FrameParser *p, uint8_t b) {
+  if (p->replay_pos == p->replay_len) {
+    p->replay_pos = p->replay_len = 0;
+    return frame_parse_byte(p, b);
+  }
+
+  if (p->replay_pos > 0) {
+    memmove(p->replay, p->replay + p->replay_pos,
+            p->replay_len - p->replay_pos);
+    p->replay_len -= p->replay_pos;
+    p->replay_pos = 0;
+  }
+  p->replay[p->replay_len++] = b;
+  return frame_parse_pending(p);
+}
+
+/* Call once the line has been quiet for FRAME_IDLE_MS. Both ends send a
+ * frame in one go, so a frame still open by then had its length damaged and
+ * is waiting for bytes that will never come, which on a quiet line can be
+ * longer than any timeout above it. Returns FRAME_BAD and gives its bytes
+ * another look, or FRAME_NONE if no frame was open. */
+static inline int frame_parse_idle(FrameParser *p) {
+  enum { HUNT, TYPE, LEN, PAYLOAD, CRC };
+  int n;
+
+  switch (p->state) {
+  case HUNT:
+    return FRAME_NONE;
+  case TYPE:
+    n = 0;
+    break;
+  case LEN:
+    n = 1;
+    break;
+  case PAYLOAD:
+    n = 2 + p->pos;
+    break;
+  default:
+    n = 2 + p->len + p->pos;
+    break;
+  }
+  p->state = HUNT;
+  frame_replay_bad(p, n);
+  return FRAME_BAD;
+}
+
+/* Hand a parsed frame to its entry in a handler table. Returns false if the
+ * type isn't in the table. */
+static inline bool frame_dispatch(const FrameHandler *table, int count,
+                                  const FrameParser *p) {
+  for (int i = 0; i < count; i++) {
+    if (table[i].type == p->type) {
+      table[i].handler(p->payload, p->len);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* ============================================================================
+ * LZ compression
+ * ============================================================================
+ *
+ * Byte oriented LZ77 where every token stands on its own, so a compressed
+ * stream can be cut into chunks anywhere and decoded as it arrives:
+ *
+ *   0nnnnnnn               n + 1 literal bytes follow
+ *   1llllddd dddddddd      copy l + 3 bytes from d + 1 bytes back
+ *
+ * The decoder only needs an LZ_WINDOW byte history. The encoder can be
+ * flushed at any point (e.g. after each streamed delta) without losing its
+ * history, so later text still matches against earlier text.
+ */
+
+#define LZ_WINDOW 2048
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 18
+#define LZ_MAX_LITERALS 128
+#define LZ_HIST 4096 /* Window plus lookahead and a literal run */
+#define LZ_HASH_BITS 12
+
+/* Worst case output of one lz_encode() + lz_flush() call for n input bytes */
+#define LZ_ENCODE_BOUND(n)                                                     \
+  ((n) + (n) / LZ_MAX_LITERALS + LZ_MAX_LITERALS + LZ_MAX_MATCH + 8)
+
+typedef struct {
+  uint8_t hist[LZ_HIST];
+  uint32_t head[1 << LZ_HASH_BITS]; /* Last position + 1 per hash, 0 = none */
+  uint32_t end;                     /* Bytes fed so far */
+  uint32_t cur;                     /* Next byte to encode */
+  uint32_t lit;                     /* Start of the pending literal run */
+} LzEncoder;
+
+typedef struct {
+  uint8_t window[LZ_WINDOW];
+  uint32_t pos;
+  int literals; /* Literal bytes left in the current run */
+  int match;    /* First byte of a match token, or -1 */
+} LzDecoder;
+
+#define LZ_HIST_AT(e, p) ((e)->hist[(p) & (LZ_HIST - 1)])
+
+static inline void lz_encoder_init(LzEncoder *e) {
+  memset(e->head, 0, sizeof(e->head));
+  e->end = e->cur = e->lit = 0;
+}
+
+static inline unsigned lz_hash(const LzEncoder *e, uint32_t p) {
+  uint32_t v = LZ_HIST_AT(e, p) | (LZ_HIST_AT(e, p + 1) << 8) |
+               (LZ_HIST_AT(e, p + 2) << 16);
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline int lz_emit_literals(LzEncoder *e, uint8_t *out) {
+  int n = 0;
+  while (e->lit < e->cur) {
+    int run = e->cur - e->lit;
+    if (run > LZ_MAX_LITERALS)
+      run = LZ_MAX_LITERALS;
+    out[n++] = run - 1;
+    while (run--)
+      out[n++] = LZ_HIST_AT(e, e->lit++);
+  }
+  return n;
+}
+
+/* Encode forward while at least `keep` bytes of lookahead remain */
+static inline int lz_encode_until(LzEncoder *e, uint32_t keep, uint8_t *out) {
+  int n = 0;
+
+  while (e->end - e->cur > keep) {
+    uint32_t avail = e->end - e->cur;
+    uint32_t best = 0, dist = 0;
+
+    if (avail >= LZ_MIN_MATCH) {
+      unsigned h = lz_hash(e, e->cur);
+      uint32_t cand = e->head[h];
+      e->head[h] = e->cur + 1;
+
+      if (cand && e->cur - (cand - 1) <= LZ_WINDOW) {
+        uint32_t limit = avail < LZ_MAX_MATCH ? avail : LZ_MAX_MATCH;
+        cand--;
+        while (best < limit &&
+               LZ_HIST_AT(e, cand + best) == LZ_HIST_AT(e, e->cur + best))
+          best++;
+        dist = e->cur - cand;
+      }
+    }
+
+    if (best >= LZ_MIN_MATCH) {
+      n += lz_emit_literals(e, out + n);
+      out[n++] = 0x80 | ((best - LZ_MIN_MATCH) << 3) | ((dist - 1) >> 8);
+      out[n++] = (dist - 1) & 0xFF;
+
+      /* Index the positions inside the match too */
+      for (uint32_t p = e->cur + 1; p < e->cur + best && p + 2 < e->end; p++)
+        e->head[lz_hash(e, p)] = p + 1;
+      e->cur += best;
+      e->lit = e->cur;
+    } else {
+      e->cur++;
+      if (e->cur - e->lit == LZ_MAX_LITERALS)
+        n += lz_emit_literals(e, out + n);
+    }
+  }
+  return n;
+}
+
+/* Feed len bytes, returns the number of bytes written to out. Up to
+ * LZ_MAX_MATCH bytes are held back as lookahead until more input arrives or
+ * lz_flush() is called. */
+static inline int lz_encode(LzEncoder *e, const uint8_t *in, int len,
+                            uint8_t *out) {
+  int n = 0;
+  while (len-- > 0) {
+    LZ_HIST_AT(e, e->end++) = *in++;
+    n += lz_encode_until(e, LZ_MAX_MATCH, out + n);
+  }
+  return n;
+}
+
+/* Emit everything fed so far. History is kept, so encoding can continue. */
+static inline int lz_flush(LzEncoder *e, uint8_t *out) {
+  int n = lz_encode_until(e, 0, out);
+  return n + lz_emit_literals(e, out + n);
+}
+
+static inline void lz_decoder_init(LzDecoder *d) {
+  d->pos = 0;
+  d->literals = 0;
+  d->match = -1;
+}
+
+/* Decode len bytes of compressed input, writing at most out_max bytes to out.
+ * Output past out_max is still tracked so the stream stays decodable.
+ * Returns the number of bytes written. */
+static inline int lz_decode(LzDecoder *d, const uint8_t *in, int len,
+                            uint8_t *out, int out_max) {
+  int n = 0;
+
+#define LZ_PUT(c)                                                              \
+  do {                                                                         \
+    uint8_t ch_ = (c);                                                         \
+    d->window[d->pos++ & (LZ_WINDOW - 1)] = ch_;                               \
+    if (n < out_max)                                                           \
+      out[n++] = ch_;                                                          \
+  } while (0)
+
+  while (len-- > 0) {
+    uint8_t b = *in++;
+    if (d->literals > 0) {
+      LZ_PUT(b);
+      d->literals--;
+    } else if (d->match >= 0) {
+      uint32_t dist = (((d->match & 0x07) << 8) | b) + 1;
+      int count = ((d->match >> 3) & 0x0F) + LZ_MIN_MATCH;
+      while (count--)
+        LZ_PUT(d->window[(d->pos - dist) & (LZ_WINDOW - 1)]);
+      d->match = -1;
+    } else if (b & 0x80) {
+      d->match = b;
+    } else {
+      d->literals = b + 1;
+    }
+  }
+
+#undef LZ_PUT
+  return n;
+}
+
+/* ============================================================================
+ * Chunk window
+ * ============================================================================
+ *
+ * Up to LINK_WINDOW chunks are in flight, each an F_CHUNK [seq][bytes]. The
+ * receiver holds chunks that arrive ahead of a gap until it is filled, NAKs
+ * each missing chunk once so only that one is resent, and ACKs cumulatively
+ * over everything delivered. An empty chunk ends the transfer. If nothing
+ * moves for LINK_RETRANSMIT_MS the sender resends the oldest chunk in
+ * flight, which covers lost NAKs and ACKs.
+ *
+ * Neither half does any I/O or reads a clock. The caller sends what they ask
+ * for and passes the time in, so both ends run the same code, and so do the
+ * link tests in tests/. The request ID in front of each chunk, ACK and NAK is
+ * the caller's too: only [seq][bytes] and seq are seen here.
+ */
+
+#define WINDOW_SLOT(seq) ((seq) & (LINK_WINDOW - 1))
+
+enum { WINDOW_IDLE = -1, WINDOW_GIVE_UP = -2 };
+
+typedef struct {
+  uint32_t off[LINK_WINDOW]; /* Where each chunk in flight starts */
+  uint8_t len[LINK_WINDOW];
+  uint8_t base;      /* Oldest unacknowledged chunk */
+  uint8_t next;      /* Seq of the next new chunk */
+  uint8_t in_flight; /* Chunks sent and not yet acknowledged */
+  uint8_t retries;   /* Resends in a row without progress */
+  uint32_t deadline; /* Time the oldest chunk is resent */
+} WindowSender;
+
+typedef struct {
+  uint8_t data[LINK_WINDOW][LINK_CHUNK_SIZE];
+  uint8_t len[LINK_WINDOW];
+  bool held[LINK_WINDOW];  /* Arrived, waiting for a gap before it */
+  bool naked[LINK_WINDOW]; /* Missing and NAKed */
+  uint8_t expected;        /* Next chunk to deliver */
+  int corrupted;           /* Bad frames during this transfer */
+} WindowReceiver;
+
+/* Sends an F_ACK or F_NAK for seq */
+typedef void (*WindowSendFn)(uint8_t type, uint8_t seq);
+/* Takes the next bytes of the transfer, in order */
+typedef void (*WindowDeliverFn)(const uint8_t *data, int len);
+
+static inline void window_sender_init(WindowSender *s) {
+  memset(s, 0, sizeof(*s));
+}
+
+static inline bool window_sender_full(const WindowSender *s) {
+  return s->in_flight == LINK_WINDOW;
+}
+
+/* Put the len bytes at off in flight as the next chunk. Returns its seq, for
+ * the caller to send. */
+static inline uint8_t window_sender_add(WindowSender *s, uint32_t off, int len,
+                                        uint32_t now) {
+  uint8_t seq = s->next++;
+
+  s->off[WINDOW_SLOT(seq)] = off;
+  s->len[WINDOW_SLOT(seq)] = len;
+  if (s->in_flight++ == 0)
+    s->deadline = now + LINK_RETRANSMIT_MS;
+  return seq;
+}
+
+/* F_ACK, everything up to seq has been delivered */
+static inline void window_sender_ack(WindowSender *s, uint8_t seq,
+                                     uint32_t now) {
+  uint8_t offset = seq - s->base;
+  if (offset >= s->in_flight)
+    return; /* Stale, already acknowledged */
+
+  s->base = seq + 1;
+  s->in_flight -= offset + 1;
+  s->retries = 0;
+  s->deadline = now + LINK_RETRANSMIT_MS;
+}
+
+/* F_NAK, returns true if seq is in flight and should be sent again */
+static inline bool window_sender_nak(const WindowSender *s, uint8_t seq) {
+  return (uint8_t)(seq - s->base) < s->in_flight;
+}
+
+/* Returns the seq to send again if nothing moved for LINK_RETRANSMIT_MS,
+ * WINDOW_GIVE_UP once that has happened LINK_MAX_RETRIES times in a row, or
+ * WINDOW_IDLE. */
+static inline int window_sender_poll(WindowSender *s, uint32_t now) {
+  if (s->in_flight == 0 || (int32_t)(now - s->deadline) <= 0)
+    return WINDOW_IDLE;
+  if (++s->retries > LINK_MAX_RETRIES)
+    return WINDOW_GIVE_UP;
+  s->deadline = now + LINK_RETRANSMIT_MS;
+  return s->base;
+}
+
+static inline void window_receiver_init(WindowReceiver *r) {
+  memset(r->held, 0, sizeof(r->held));
+  memset(r->naked, 0, sizeof(r->naked));
+  r->expected = 0;
+  r->corrupted = 0;
+}
+
+/* A chunk failed its CRC. Nothing in it can be trusted, but the oldest hole
+ * is the best guess at what got hit. It is only NAKed once like any other,
+ * as one damaged byte can make several bad frames and each NAK costs a
+ * resend. */
+static inline void window_receive_bad(WindowReceiver *r, WindowSendFn send) {
+  int slot = WINDOW_SLOT(r->expected);
+
+  r->corrupted++;
+  if (!r->naked[slot]) {
+    send(F_NAK, r->expected);
+    r->naked[slot] = true;
+  }
+}
+
+/* Take an intact F_CHUNK payload. Returns true once the empty chunk that ends
+ * the transfer has been delivered. */
+static inline bool window_receive(WindowReceiver *r, const uint8_t *payload,
+                                  int len, WindowSendFn send,
+                                  WindowDeliverFn deliver) {
+  if (len < 1 || len - 1 > LINK_CHUNK_SIZE) {
+    window_receive_bad(r, send);
+    return false;
+  }
+
+  uint8_t seq = payload[0];
+  uint8_t ahead = seq - r->expected;
+  if (ahead >= LINK_WINDOW) {
+    /* Resend of something already delivered, our ACK must have been lost */
+    send(F_ACK, r->expected - 1);
+    return false;
+  }
+
+  int slot = WINDOW_SLOT(seq);
+  r->len[slot] = len - 1;
+  memcpy(r->data[slot], payload + 1, len - 1);
+  r->held[slot] = true;
+
+  for (uint8_t i = 0; i < ahead; i++) {
+    int gap = WINDOW_SLOT(r->expected + i);
+    if (!r->held[gap] && !r->naked[gap]) {
+      send(F_NAK, r->expected + i);
+      r->naked[gap] = true;
+    }
+  }
+
+  /* Deliver everything that is now in order */
+  bool delivered = false, finished = false;
+  while (!finished && r->held[slot = WINDOW_SLOT(r->expected)]) {
+    finished = r->len[slot] == 0;
+    deliver(r->data[slot], r->len[slot]);
+    r->held[slot] = r->naked[slot] = false;
+    r->expected++;
+    delivered = true;
+  }
+
+  if (delivered)
+    send(F_ACK, r->expected - 1);
+  return finished;
+}
+
+#endif
@@ -13,6 +13,8 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 
+#include "protocol.h"
+
 // ============================================================================
 // CONFIGURATION - Edit these values
 // ============================================================================
@@ -36,6 +38,18 @@
 #define LOCAL_LLM_PORT 8080
 #endif
 
+// Send text to the Nspire as the model generates it instead of buffering the
+// whole reply first. Comment out to send the reply once it is complete
+#define STREAM_RESPONSES
+
+// Offer LZ compressed responses to the Nspire during the handshake.
+// Comment out to always send plain text
+#define COMPRESS_RESPONSES
+
+// Let the Nspire upload the chat history LZ compressed.
+// Comment out to always receive plain JSON
+#define COMPRESS_REQUESTS
+
 // ============================================================================
 // Constants
 // ============================================================================
@@ -43,8 +57,11 @@
 #define UART_RX_PIN 20
 #define UART_TX_PIN 21
 #define BAUD_RATE 115200
-#define EOT_CHAR 0x04
-#define MAX_REQUEST_SIZE 8192
+// Highest rate the Nspire may negotiate after READY. Its PL011 tops out at
+// 750000. Set to BAUD_RATE to disable negotiation
+#define MAX_BAUD_RATE 750000
+#define MAX_REQUEST_SIZE 8192 // Must match MAX_REQUEST_SIZE in main.c
+#define MAX_SESSION_TURNS 20 // Must match MAX_HISTORY_TURNS in main.c
 #define IDLE_SLEEP_TIMEOUT_MS 30000
 #define UART_WAKEUP_THRESHOLD 3 // Number of RX edges to wake from light-sleep
 
@@ -60,9 +77,20 @@ WiFiClientSecure client;
 #endif
 
 bool handshakeComplete = false;
+FrameParser linkRx;
 char requestBuffer[MAX_REQUEST_SIZE];
 int reqIdx = 0;
+uint8_t reqSeq = 0;        // next expected F_REQ sequence number
+bool reqCorrupt = false;   // a request frame was lost or damaged
+bool requestReady = false; // F_REQ_END seen, run it from loop()
+uint8_t reqId = 0;         // request ID from F_REQ_END
+int syncCount = 0;         // F_SYNC frames seen, for onBaud()
+bool requestActive = false; // sendApiRequest() is running
+bool cancelled = false;     // F_CANCEL arrived while it was
+uint32_t g_sessionId = 0;   // picked at boot, see "Conversation session"
 unsigned long lastActivityTime = 0; // for idle sleep
+bool compressResponses = false;     // negotiated with CAPS:
+bool compressRequests = false;      // negotiated with CAPS:
 
 // ============================================================================
 // Setup
@@ -74,8 +102,8 @@ void setup() {
   Serial.println("\n=== Renspired Gateway ===");
 
   // Initialize UART to Nspire
-  // 230400 baud technically seems to work
-  // but isn't worth the extra risk with our throughput requirements
+  // Always start at BAUD_RATE, the Nspire negotiates anything faster after
+  // the handshake and both sides fall back if the test pattern doesn't survive
   NspireUART.begin(BAUD_RATE, SERIAL_8N1, UART_RX_PIN, UART_TX_PIN);
   NspireUART.setRxBufferSize(4096);
 
@@ -99,8 +127,10 @@ void setup() {
 #endif
 
   // Clear state and signal ready
+  g_sessionId = esp_random();
   handshakeComplete = false;
-  reqIdx = 0;
+  frame_parser_init(&linkRx);
+  resetRequest();
   memset(requestBuffer, 0, sizeof(requestBuffer));
   lastActivityTime = millis();
 
@@ -110,47 +140,305 @@ void setup() {
   Serial.println("Ready. Wait for handshake...");
 }
 
+// ============================================================================
+// Link framing
+// ============================================================================
+
+void sendFrame(uint8_t type, const void *payload, int len) {
+  uint8_t frame[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+  NspireUART.write(frame, frame_encode(frame, type, payload, len));
+}
+
+void sendError(const char *code) {
+  sendFrame(F_ERR, code, strlen(code));
+  NspireUART.flush();
+}
+
+void sendProgress(uint8_t stage) { sendFrame(F_PROGRESS, &stage, 1); }
+
+// Every frame the Nspire can send us is handled through this table, both
+// during the handshake and while a response is going out
+void onSync(const uint8_t *payload, int len);
+void onRst(const uint8_t *payload, int len);
+void onBaud(const uint8_t *payload, int len);
+void onCaps(const uint8_t *payload, int len);
+void onReq(const uint8_t *payload, int len);
+void onReqEnd(const uint8_t *payload, int len);
+void onLog(const uint8_t *payload, int len);
+void onAck(const uint8_t *payload, int len);
+void onNak(const uint8_t *payload, int len);
+void onCancel(const uint8_t *payload, int len);
+void onStatus(const uint8_t *payload, int len);
+
+static const FrameHandler linkHandlers[] = {
+    {F_SYNC, onSync},     {F_RST, onRst},       {F_BAUD, onBaud},
+    {F_CAPS, onCaps},     {F_REQ, onReq},       {F_REQ_END, onReqEnd},
+    {F_LOG, onLog},       {F_ACK, onAck},       {F_NAK, onNak},
+    {F_CANCEL, onCancel}, {F_STATUS, onStatus},
+};
+
+// Parse and dispatch everything waiting on the UART
+void pollLink() {
+  while (true) {
+    int r = frame_parse_pending(&linkRx);
+    if (r == FRAME_NONE) {
+      if (NspireUART.available()) {
+        lastActivityTime = millis(); // Reset idle timer on any UART activity
+        r = frame_parse(&linkRx, NspireUART.read());
+      } else if (millis() - lastActivityTime < FRAME_IDLE_MS ||
+                 (r = frame_parse_idle(&linkRx)) == FRAME_NONE) {
+        break; // Drained, and no frame left hanging
+      }
+    }
+
+    if (r == FRAME_OK) {
+      frame_dispatch(linkHandlers,
+                     sizeof(linkHandlers) / sizeof(linkHandlers[0]), &linkRx);
+    } else if (r == FRAME_BAD && reqSeq > 0) {
+      reqCorrupt = true; // Damaged mid-upload
+    }
+  }
+}
+
+void onSync(const uint8_t *payload, int len) {
+  uint8_t session[4];
+  frame_put_u32(session, g_sessionId);
+  sendFrame(F_READY, session, 4);
+  NspireUART.flush();
+  syncCount++;
+  if (!handshakeComplete) {
+    handshakeComplete = true;
+    resetRequest();
+    Serial.println("Handshake complete");
+  }
+}
+
+void onRst(const uint8_t *payload, int len) { ESP.restart(); }
+
+// A freshly launched Nspire app asks this before deciding whether we need a
+// reset. If we're associated it carries on with our wireless connection as
+// is, so this starts a new conversation and abandons anything left running
+// for the old one.
+void onStatus(const uint8_t *payload, int len) {
+  if (requestActive)
+    cancelled = true;
+  if (requestReady)
+    resetRequest(); // Or loop() would still run it
+  sessionClear();
+  g_sessionId = esp_random();
+
+  uint8_t status = WiFi.status() == WL_CONNECTED ? STATUS_WIFI : 0;
+  sendFrame(F_STATUS, &status, 1);
+  NspireUART.flush();
+  Serial.printf("Status check, wireless %s\n", status ? "up" : "down");
+}
+
+void onLog(const uint8_t *payload, int len) {
+  // Debug message from Nspire - print to Serial monitor
+  Serial.printf("DBG:%.*s\n", len, (const char *)payload);
+}
+
 // ============================================================================
 // Handshake with Nspire
 // ============================================================================
 
 void handleHandshake() {
-  static char buf[32];
-  static int idx = 0;
   static unsigned long lastReadyTime = 0;
 
   if (millis() - lastActivityTime > IDLE_SLEEP_TIMEOUT_MS) {
-    idx = 0; // Reset buffer before sleeping
     enterLightSleep();
   }
 
-  // Send ESP_READY often in case the nspire misses it
+  // Send HELLO often in case the nspire misses it
   if (millis() - lastReadyTime >= 1000) {
-    NspireUART.print("ESP_READY\n");
+    sendFrame(F_HELLO, NULL, 0);
     lastReadyTime = millis();
   }
 
-  while (NspireUART.available()) {
-    char c = NspireUART.read();
-    lastActivityTime = millis(); // Reset idle timer
-
-    if (c == '\n') {
-      buf[idx] = '\0';
-
-      if (strcmp(buf, "SYNC") == 0) {
-        NspireUART.print("READY\n");
-        NspireUART.flush();
-        handshakeComplete = true;
-        reqIdx = 0;
-        lastActivityTime = millis();
-        Serial.println("Handshake complete");
-      } else if (strcmp(buf, "RST") == 0) {
-        ESP.restart();
-      }
-      idx = 0;
-    } else if (c != '\r' && idx < 31) {
-      buf[idx++] = c;
+  pollLink();
+}
+
+// ============================================================================
+// Baud rate negotiation
+// ============================================================================
+
+// Handle F_BAUD from the Nspire. Both sides switch after F_BAUD_OK, then we
+// send the test pattern at the new rate and expect SYNC back. Anything else
+// and we drop back to BAUD_RATE, which is what the Nspire does too.
+void onBaud(const uint8_t *payload, int len) {
+  if (len < 4)
+    return;
+
+  unsigned long rate = frame_get_u32(payload);
+  if (rate != BAUD_RATE && (rate < BAUD_RATE || rate > MAX_BAUD_RATE)) {
+    sendFrame(F_BAUD_NO, NULL, 0);
+    return;
+  }
+
+  sendFrame(F_BAUD_OK, NULL, 0);
+  NspireUART.flush();
+  NspireUART.updateBaudRate(rate);
+  frame_parser_init(&linkRx);
+  delay(20); // Let the Nspire reprogram its divisors
+
+  // onSync() answers READY when it arrives. The Nspire switches from its
+  // main loop, which may be busy drawing, so the pattern is repeated until
+  // then rather than sent once.
+  int syncs = syncCount;
+  unsigned long start = millis(), lastTest = start - 50;
+  while (millis() - start < 500) {
+    if (millis() - lastTest >= 50) {
+      sendFrame(F_BAUD_TEST, LINK_BAUD_TEST, sizeof(LINK_BAUD_TEST) - 1);
+      NspireUART.flush();
+      lastTest = millis();
     }
+    pollLink();
+    if (syncCount != syncs) {
+      Serial.printf("Baud rate now %lu\n", rate);
+      return;
+    }
+    yield();
+  }
+
+  Serial.printf("Baud rate %lu failed, fall back to %d\n", rate, BAUD_RATE);
+  NspireUART.updateBaudRate(BAUD_RATE);
+  frame_parser_init(&linkRx);
+}
+
+// ============================================================================
+// Optional features
+// ============================================================================
+
+// Handle F_CAPS from the Nspire, answer with what we'll actually use
+void onCaps(const uint8_t *payload, int len) {
+  uint8_t wanted = len > 0 ? payload[0] : 0;
+  uint8_t granted = 0;
+
+#ifdef COMPRESS_RESPONSES
+  granted |= wanted & CAP_LZ;
+#endif
+#ifdef COMPRESS_REQUESTS
+  granted |= wanted & CAP_LZUP;
+#endif
+  compressResponses = granted & CAP_LZ;
+  compressRequests = granted & CAP_LZUP;
+
+  sendFrame(F_CAPS, &granted, 1);
+  NspireUART.flush();
+  Serial.printf("Compression: responses %s, requests %s\n",
+                compressResponses ? "yes" : "no",
+                compressRequests ? "yes" : "no");
+}
+
+// ============================================================================
+// Request upload
+// ============================================================================
+
+// The request arrives as F_REQ frames of [seq][bytes], either plain JSON or
+// LZ data depending on CAPS, and F_REQ_END marks it complete
+static LzDecoder g_upLz;
+
+void resetRequest() {
+  reqIdx = 0;
+  reqSeq = 0;
+  reqCorrupt = false;
+  requestReady = false;
+  lz_decoder_init(&g_upLz);
+}
+
+void onReq(const uint8_t *payload, int len) {
+  if (len < 1)
+    return;
+  if (payload[0] != reqSeq)
+    reqCorrupt = true;
+  reqSeq = payload[0] + 1;
+
+  const uint8_t *data = payload + 1;
+  int room = MAX_REQUEST_SIZE - 1 - reqIdx;
+  len--;
+
+  if (compressRequests) {
+    reqIdx += lz_decode(&g_upLz, data, len, (uint8_t *)requestBuffer + reqIdx,
+                        room);
+  } else {
+    len = min(len, room);
+    memcpy(requestBuffer + reqIdx, data, len);
+    reqIdx += len;
+  }
+}
+
+void onReqEnd(const uint8_t *payload, int len) {
+  requestBuffer[reqIdx] = '\0';
+  reqId = len >= 1 ? payload[0] : 0;
+  requestReady = true;
+}
+
+// The Nspire gave up on its request. sendApiRequest() notices the flag, and
+// the F_CANCEL echo goes out once it has returned, so the Nspire knows
+// nothing else is coming. Otherwise the request hasn't started: it may be
+// complete but not yet run, or half uploaded because F_REQ_END was lost.
+// Either way it is dropped, so the next upload starts clean at seq 0.
+void onCancel(const uint8_t *payload, int len) {
+  if (requestActive) {
+    cancelled = true;
+  } else {
+    resetRequest();
+    sendFrame(F_CANCEL, NULL, 0);
+    NspireUART.flush();
+  }
+}
+
+// ============================================================================
+// Conversation session
+// ============================================================================
+
+// The conversation lives here rather than being uploaded with every prompt.
+// The Nspire gets g_sessionId in READY and sends it back with the number of
+// turns it thinks we have. If either doesn't match (we restarted, or a turn
+// got lost) it is told to upload the whole history once instead.
+struct SessionTurn {
+  const char *role; // "user" or "model"
+  char *text;
+};
+
+static SessionTurn g_turns[MAX_SESSION_TURNS];
+static int g_turnCount = 0;
+
+void sessionClear() {
+  for (int i = 0; i < g_turnCount; i++)
+    free(g_turns[i].text);
+  g_turnCount = 0;
+}
+
+// Same policy as history_add() on the Nspire: drop the oldest turn when full
+void sessionAdd(const char *role, const char *text, int len) {
+  // Long chats fit in PSRAM where the board has it
+  char *copy = (char *)(psramFound() ? ps_malloc(len + 1) : malloc(len + 1));
+  if (!copy) {
+    Serial.println("Out of memory for session, start over");
+    sessionClear();
+    return;
+  }
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+
+  if (g_turnCount == MAX_SESSION_TURNS) {
+    free(g_turns[0].text);
+    memmove(&g_turns[0], &g_turns[1],
+            (MAX_SESSION_TURNS - 1) * sizeof(SessionTurn));
+    g_turnCount--;
+  }
+  g_turns[g_turnCount].role = strcmp(role, "model") == 0 ? "model" : "user";
+  g_turns[g_turnCount].text = copy;
+  g_turnCount++;
+}
+
+// Replace the session with a full history upload, in Gemini format
+void sessionLoad(JsonArray history) {
+  sessionClear();
+  for (JsonVariant turn : history) {
+    const char *text = turn["parts"][0]["text"] | "";
+    sessionAdd(turn["role"] | "user", text, strlen(text));
   }
 }
 
@@ -162,13 +450,180 @@ void handleHandshake() {
 #define MAX_RESPONSE_BUF 8192
 static char g_responseBuf[MAX_RESPONSE_BUF];
 static int g_responseLen = 0;
+static bool g_responseSent = false; // every chunk was acknowledged
+
+// What actually goes over the wire: g_responseBuf itself, or its LZ
+// compressed form when the Nspire negotiated compression
+static const uint8_t *g_wire = (const uint8_t *)g_responseBuf;
+static int g_wireLen = 0;
+#ifdef COMPRESS_RESPONSES
+static LzEncoder g_lz;
+static uint8_t g_lzBuf[MAX_RESPONSE_BUF + MAX_RESPONSE_BUF / 4];
+#endif
+
+void resetResponse() {
+  g_responseLen = 0;
+  g_responseSent = false;
+  g_responseBuf[0] = '\0';
+  g_wireLen = 0;
+  g_wire = (const uint8_t *)g_responseBuf;
+#ifdef COMPRESS_RESPONSES
+  if (compressResponses) {
+    lz_encoder_init(&g_lz);
+    g_wire = g_lzBuf;
+  }
+#endif
+}
+
+// Push out whatever the encoder is holding back for lookahead. Only done when
+// the link would otherwise sit idle, so a busy link still gets long matches.
+void flushWire() {
+#ifdef COMPRESS_RESPONSES
+  if (compressResponses)
+    g_wireLen += lz_flush(&g_lz, g_lzBuf + g_wireLen);
+#endif
+}
+
+// Response transfer: chunks are cut from the wire buffer and sent through the
+// chunk window in protocol.h, which decides what goes out again
+static WindowSender g_window;
+static uint8_t g_respId = 0; // reqId of the request being answered
+static int g_sentLen = 0; // bytes of the wire buffer cut into chunks
+static int g_resent = 0;
+static bool g_sendFailed = false;
+static bool g_finishing = false; // queue the terminator once data runs out
+
+#ifdef STREAM_RESPONSES
+static bool g_streaming = false;
+#endif
+
+void resetSender() {
+  window_sender_init(&g_window);
+  g_sentLen = 0;
+  g_resent = 0;
+  g_sendFailed = false;
+  g_finishing = false;
+}
+
+void sendChunk(uint8_t seq) {
+  uint8_t payload[2 + LINK_CHUNK_SIZE];
+  int slot = WINDOW_SLOT(seq);
+  payload[0] = g_respId;
+  payload[1] = seq;
+  memcpy(payload + 2, g_wire + g_window.off[slot], g_window.len[slot]);
+  sendFrame(F_CHUNK, payload, 2 + g_window.len[slot]);
+}
+
+void queueChunk(int len) {
+  sendChunk(window_sender_add(&g_window, g_sentLen, len, millis()));
+  g_sentLen += len;
+}
+
+// F_ACK [id][seq] acknowledges everything up to seq, F_NAK [id][seq] asks
+// for one chunk again. Either for an earlier response is stale.
+void onAck(const uint8_t *payload, int len) {
+  if (len >= 2 && payload[0] == g_respId)
+    window_sender_ack(&g_window, payload[1], millis());
+}
+
+void onNak(const uint8_t *payload, int len) {
+  if (len >= 2 && payload[0] == g_respId &&
+      window_sender_nak(&g_window, payload[1])) {
+    sendChunk(payload[1]);
+    g_resent++;
+  }
+}
+
+// Fill the window with pending response bytes. With wait set, block until
+// everything buffered so far has been sent and acknowledged.
+void pumpChunks(bool wait) {
+  while (!g_sendFailed) {
+    pollLink();
+    if (cancelled) {
+      g_sendFailed = true;
+      return;
+    }
+
+    int pending = g_wireLen - g_sentLen;
+    if (!window_sender_full(&g_window)) {
+      if (pending <= 0) {
+        flushWire();
+        pending = g_wireLen - g_sentLen;
+      }
+      if (pending > 0) {
+        queueChunk(min(LINK_CHUNK_SIZE, pending));
+        continue;
+      }
+      if (g_finishing) {
+        queueChunk(0);
+        g_finishing = false;
+        continue;
+      }
+    }
+
+    int resend = window_sender_poll(&g_window, millis());
+    if (resend == WINDOW_GIVE_UP) {
+      Serial.printf("No ACK for chunk %d, abort\n", g_window.base);
+      g_sendFailed = true;
+      return;
+    }
+    if (resend >= 0) {
+      sendChunk(resend);
+      g_resent++;
+    }
+    if (!wait || (pending <= 0 && !g_finishing && g_window.in_flight == 0))
+      return;
+    yield();
+  }
+}
+
+void finishChunks() {
+  g_finishing = true;
+  pumpChunks(true);
+  g_responseSent = !g_sendFailed;
+
+  NspireUART.flush();
+  Serial.printf("\n--- Response sent: %d bytes as %d, %d chunks resent ---\n",
+                g_responseLen, g_sentLen, g_resent);
+}
+
+// Announce the response. A length of 0 means it is streamed and ends with an
+// empty chunk rather than at a known size.
+void beginResponse(uint32_t length) {
+  uint8_t payload[5];
+  frame_put_u32(payload, length);
+  payload[4] = g_respId;
+  sendFrame(F_RESP, payload, 5);
+  resetSender();
+}
+
+#ifdef STREAM_RESPONSES
+void beginStream() {
+  beginResponse(0);
+  g_streaming = true;
+}
+#endif
 
 void appendToResponse(const char *text, int len) {
   if (g_responseLen + len < MAX_RESPONSE_BUF) {
+#ifdef COMPRESS_RESPONSES
+    if (compressResponses) {
+      if (g_wireLen + LZ_ENCODE_BOUND(len) > (int)sizeof(g_lzBuf))
+        return;
+      g_wireLen += lz_encode(&g_lz, (const uint8_t *)text, len,
+                             g_lzBuf + g_wireLen);
+    }
+#endif
     memcpy(g_responseBuf + g_responseLen, text, len);
     g_responseLen += len;
     g_responseBuf[g_responseLen] = '\0';
+    if (!compressResponses)
+      g_wireLen = g_responseLen;
   }
+#ifdef STREAM_RESPONSES
+  if (g_streaming)
+    pumpChunks(false);
+#endif
 }
 
 void processJsonLine(const String &line) {
@@ -251,34 +706,59 @@ void processJsonLine(const String &line) {
 // API request handling
 // ============================================================================
 
+void endRequest() {
+  client.stop();
+  // The Nspire keeps the reply only if it got all of it, so do the same
+  if (g_responseSent && !cancelled && g_responseLen > 0)
+    sessionAdd("model", g_responseBuf, g_responseLen);
+  if (cancelled) {
+    Serial.println("Request cancelled");
+    sendFrame(F_CANCEL, NULL, 0);
+    NspireUART.flush();
+  }
+  requestActive = cancelled = false;
+}
+
 void sendApiRequest(const char *requestJson) {
   Serial.println("Starting API request...");
-  g_responseLen = 0; // Reset buffer
-  g_responseBuf[0] = '\0';
-
-  // Alert user if wireless isn't connected
-  if (WiFi.status() != WL_CONNECTED) {
-    NspireUART.print("ERR:NET\n");
-    NspireUART.write(EOT_CHAR);
-    return;
-  }
+  resetResponse();
 
   // Parse incoming request from nspire
   JsonDocument reqDoc;
   DeserializationError error = deserializeJson(reqDoc, requestJson);
   if (error) {
     Serial.printf("Request parse error: %s\n", error.c_str());
-    NspireUART.print("ERR:API\n");
-    NspireUART.write(EOT_CHAR);
+    sendError("API");
     return;
   }
 
-  const char *currentPrompt = reqDoc["current_prompt"];
+  // Bring the session up to date. The prompt counts as a turn from here on,
+  // whatever happens to the request. The Nspire does the same once it sees
+  // progress, the response, or an error other than API, LINK or SESSION, so
+  // nothing that can fail before this point may send a progress frame.
+  const char *currentPrompt = reqDoc["current_prompt"] | "";
   JsonArray history = reqDoc["history"];
+  if (!history.isNull()) {
+    sessionLoad(history);
+  } else if (reqDoc["session"].as<uint32_t>() != g_sessionId ||
+             reqDoc["turns"].as<int>() != g_turnCount) {
+    Serial.println("Session out of step, ask for the full history");
+    sendError("SESSION");
+    return;
+  }
+  sessionAdd("user", currentPrompt, strlen(currentPrompt));
+  Serial.printf("Session has %d turns\n", g_turnCount);
+
+  // Alert user if wireless isn't connected
+  if (WiFi.status() != WL_CONNECTED) {
+    sendError("NET");
+    return;
+  }
 
   // Connect to API (retry up to 3 times)
+  sendProgress(PROGRESS_CONNECTING);
   bool connected = false;
-  for (int attempt = 0; attempt < 3; attempt++) {
+  for (int attempt = 0; attempt < 3 && !cancelled; attempt++) {
 #ifdef USE_LOCAL_LLM
     if (client.connect(LOCAL_LLM_HOST, LOCAL_LLM_PORT)) {
 #else
@@ -290,11 +770,13 @@ void sendApiRequest(const char *requestJson) {
     Serial.printf("Connection attempt %d failed, retrying...\n", attempt + 1);
     client.stop();
     delay(500);
+    pollLink();
   }
+  if (cancelled)
+    return;
   if (!connected) {
     Serial.println("Connection failed after 3 attempts");
-    NspireUART.print("ERR:NET\n");
-    NspireUART.write(EOT_CHAR);
+    sendError("NET");
     return;
   }
 
@@ -313,21 +795,13 @@ void sendApiRequest(const char *requestJson) {
   sysMsg["content"] = SYSTEM_PROMPT;
 #endif
 
-  // Add history
-  for (JsonVariant turn : history) {
+  // Add the conversation, which ends with the current prompt
+  for (int i = 0; i < g_turnCount; i++) {
     JsonObject msg = messages.add<JsonObject>();
-    msg["role"] = turn["role"];
-    // Convert Gemini parts format to openai content format
-    if (turn["parts"].is<JsonArray>() && turn["parts"].size() > 0) {
-      msg["content"] = turn["parts"][0]["text"];
-    }
+    msg["role"] = g_turns[i].role;
+    msg["content"] = g_turns[i].text;
   }
 
-  // Add current prompt
-  JsonObject userMsg = messages.add<JsonObject>();
-  userMsg["role"] = "user";
-  userMsg["content"] = currentPrompt;
-
   bodyDoc["stream"] = true;
   serializeJson(bodyDoc, body);
 
@@ -347,18 +821,15 @@ void sendApiRequest(const char *requestJson) {
 
   JsonArray contents = bodyDoc["contents"].to<JsonArray>();
 
-  // Add history, should already be in Gemini format
-  for (JsonVariant turn : history) {
-    contents.add(turn);
+  // Add the conversation, which ends with the current prompt
+  for (int i = 0; i < g_turnCount; i++) {
+    JsonObject turn = contents.add<JsonObject>();
+    turn["role"] = g_turns[i].role;
+    JsonArray parts = turn["parts"].to<JsonArray>();
+    JsonObject textPart = parts.add<JsonObject>();
+    textPart["text"] = g_turns[i].text;
   }
 
-  // Add current prompt
-  JsonObject userTurn = contents.add<JsonObject>();
-  userTurn["role"] = "user";
-  JsonArray parts = userTurn["parts"].to<JsonArray>();
-  JsonObject textPart = parts.add<JsonObject>();
-  textPart["text"] = currentPrompt;
-
   serializeJson(bodyDoc, body);
 
   String url =
@@ -377,6 +848,7 @@ void sendApiRequest(const char *requestJson) {
   client.print(body);
 
   Serial.println("Request sent, reading response...");
+  sendProgress(PROGRESS_WAITING);
 
   // Read response
   bool headersComplete = false;
@@ -388,6 +860,11 @@ void sendApiRequest(const char *requestJson) {
   unsigned long timeout = millis() + 60000;
 
   while ((client.connected() || client.available()) && millis() < timeout) {
+    // Check for F_CANCEL between lines
+    pollLink();
+    if (cancelled)
+      break;
+
     if (client.available()) {
       String line = client.readStringUntil('\n');
 
@@ -420,11 +897,14 @@ void sendApiRequest(const char *requestJson) {
         if (lineCount == 5 || !client.available()) {
           if (isError) {
             Serial.println("Found API error");
-            NspireUART.print("ERR:QUOTA\n"); // it might not be always quota but
-                                             // let's be real it always is
+            sendError("QUOTA"); // it might not be always quota but
+                                // let's be real it always is
           } else {
             Serial.println("Response OK");
-            NspireUART.print("OK\n");
+            sendProgress(PROGRESS_GENERATING);
+#ifdef STREAM_RESPONSES
+            beginStream();
+#endif
           }
           NspireUART.flush();
           sentStatus = true;
@@ -447,18 +927,34 @@ void sendApiRequest(const char *requestJson) {
         processJsonLine(line);
       }
     }
+#ifdef STREAM_RESPONSES
+    if (g_streaming) {
+      pumpChunks(false);
+      if (g_sendFailed)
+        break;
+    }
+#endif
     yield();
   }
 
+  if (cancelled) {
+#ifdef STREAM_RESPONSES
+    g_streaming = false;
+#endif
+    return;
+  }
+
   // Handle short responses
   if (!sentStatus) {
     if (firstLines.indexOf("RESOURCE_EXHAUSTED") != -1 ||
         firstLines.indexOf("\"code\": 429") != -1) {
-      NspireUART.print("ERR:QUOTA\n");
-      NspireUART.write(EOT_CHAR);
+      sendError("QUOTA");
       client.stop();
       return;
     } else {
+#ifdef STREAM_RESPONSES
+      beginStream();
+#endif
       int start = 0;
       int end;
       while ((end = firstLines.indexOf('\n', start)) != -1) {
@@ -468,66 +964,21 @@ void sendApiRequest(const char *requestJson) {
     }
   }
 
-  // Send buffered response with packet protocol
-  Serial.printf("\n--- Response buffered: %d bytes ---\n", g_responseLen);
-
-  // Send length header
-  NspireUART.printf("LEN:%d\n", g_responseLen);
-  NspireUART.flush();
-
-  Serial.println("Wait for ACK of LEN");
-  unsigned long ackTimeout = millis() + 5000;
-  bool gotAck = false;
-  while (millis() < ackTimeout && !gotAck) {
-    if (NspireUART.available()) {
-      char c = NspireUART.read();
-      if (c == 'A')
-        gotAck = true;
-    }
-    yield();
-  }
-
-  if (!gotAck) {
-    Serial.println("No ACK received, abort");
-    NspireUART.write(EOT_CHAR);
+#ifdef STREAM_RESPONSES
+  if (g_streaming) {
+    g_streaming = false;
+    finishChunks();
     client.stop();
     return;
   }
-  Serial.println("ACK received, send data");
-
-  // Crazy motherfucker named packets
-  const int CHUNK_SIZE = 64;
-  int sent = 0;
-  while (sent < g_responseLen) {
-    int chunkLen = min(CHUNK_SIZE, g_responseLen - sent);
-
-    NspireUART.write((uint8_t *)(g_responseBuf + sent), chunkLen);
-    NspireUART.flush();
-    sent += chunkLen;
-
-    // Wait for ACK
-    ackTimeout = millis() + 2000;
-    gotAck = false;
-    while (millis() < ackTimeout && !gotAck) {
-      if (NspireUART.available()) {
-        char c = NspireUART.read();
-        if (c == 'A')
-          gotAck = true;
-      }
-      yield();
-    }
-
-    if (!gotAck) {
-      Serial.printf("No ACK at offset %d, abort\n", sent);
-      break;
-    }
-    Serial.printf("Packet sent: %d/%d\n", sent, g_responseLen);
-  }
+#endif
 
-  NspireUART.write(EOT_CHAR);
-  NspireUART.flush();
+  // Send buffered response with packet protocol
+  Serial.printf("\n--- Response buffered: %d bytes ---\n", g_responseLen);
 
-  Serial.println("Sent response");
+  // Crazy motherfucker named packets
+  beginResponse(g_responseLen);
+  finishChunks();
   client.stop();
 }
 
@@ -557,6 +1008,14 @@ void enterLightSleep() {
     NspireUART.read();
   }
 
+  // Announce ourselves before the reconnect below, which can take 10 s. The
+  // Nspire keeps probing until then, and its STATUS waits in the UART buffer
+  // to be answered once WiFi is back.
+  frame_parser_init(&linkRx);
+  sendFrame(F_AWAKE, NULL, 0);
+  NspireUART.flush();
+  Serial.println("Sent AWAKE");
+
   // Force full WiFi reconnect after sleep.
   // WiFi.status() can report WL_CONNECTED from cached state even after the AP
   // has deauthenticated us during a longer sleep.
@@ -575,10 +1034,6 @@ void enterLightSleep() {
   // Force-close any stale TLS session from before sleep
   client.stop();
 
-  NspireUART.print("AWAKE\n");
-  NspireUART.flush();
-  Serial.println("Sent AWAKE");
-
   lastActivityTime = millis();
 }
 
@@ -596,28 +1051,28 @@ void loop() {
     enterLightSleep();
   }
 
-  while (NspireUART.available()) {
-    char c = NspireUART.read();
-    lastActivityTime = millis(); // Reset idle timer on any UART activity
-
-    if (c == '\n') {
-      requestBuffer[reqIdx] = '\0';
-
-      if (strcmp(requestBuffer, "SYNC") == 0) {
-        NspireUART.print("READY\n");
-        NspireUART.flush();
-      } else if (strcmp(requestBuffer, "RST") == 0) {
-        ESP.restart();
-      } else if (strncmp(requestBuffer, "DBG:", 4) == 0) {
-        // Debug message from Nspire - print to Serial monitor
-        Serial.println(requestBuffer);
-      } else if (reqIdx > 0 && requestBuffer[0] == '{') {
-        sendApiRequest(requestBuffer);
-      }
-
-      reqIdx = 0;
-    } else if (c != '\r' && reqIdx < MAX_REQUEST_SIZE - 1) {
-      requestBuffer[reqIdx++] = c;
+  pollLink();
+
+  // Run the request here rather than from onReqEnd() so its own frames
+  // (ACKs for the response) can be dispatched while it goes out. It is
+  // taken off the upload state first: the next request may start arriving
+  // while this one runs, and must be left for the next pass. requestBuffer
+  // is only read before anything is polled, as reqDoc copies the strings.
+  if (requestReady) {
+    bool damaged = reqCorrupt;
+    uint8_t id = reqId;
+    resetRequest();
+
+    if (damaged) {
+      Serial.println("Request damaged in transit");
+      sendError("LINK");
+    } else if (requestBuffer[0] == '{') {
+      requestActive = true;
+      g_respId = id;
+      sendApiRequest(requestBuffer);
+      endRequest();
+    } else {
+      sendError("API");
     }
   }
 }
@@ -2,15 +2,20 @@
  * Renspired - TI-Nspire Gemini Bridge
  *
  * Access LLMs via ESP32 gateway.
- * Press ESC to exit, Up/Down to scroll.
+ * Press ESC to exit or cancel a pending reply, Up/Down to scroll and
+ * CTRL+Up/Down to page.
  */
 
 #include <libndls.h>
 #include <nspireio/nspireio.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "esp32/renspired/protocol.h"
+
 /* ============================================================================
  * UART Hardware
  * ============================================================================
@@ -24,21 +29,75 @@
 #define UART_FBRD (*(volatile unsigned *)(UART_BASE + 0x28))
 #define UART_LCR_H (*(volatile unsigned *)(UART_BASE + 0x2C))
 #define UART_CR (*(volatile unsigned *)(UART_BASE + 0x30))
+#define UART_IFLS (*(volatile unsigned *)(UART_BASE + 0x34))
+#define UART_IMSC (*(volatile unsigned *)(UART_BASE + 0x38))
+#define UART_MIS (*(volatile unsigned *)(UART_BASE + 0x40))
+#define UART_ICR (*(volatile unsigned *)(UART_BASE + 0x44))
 
 #define UART_FR_TXFF (1 << 5)
 #define UART_FR_TXFE (1 << 7)
 #define UART_FR_BUSY (1 << 3)
+#define UART_FR_RXFE (1 << 4)
 #define UART_LCR_8BIT (3 << 5)
 #define UART_LCR_FEN (1 << 4)
 #define UART_CR_UARTEN (1 << 0)
 #define UART_CR_TXE (1 << 8)
 #define UART_CR_RXE (1 << 9)
+#define UART_IFLS_RX_HALF (2 << 3)
+#define UART_IFLS_TX_HALF (2 << 0)
+#define UART_INT_RX (1 << 4)
+#define UART_INT_TX (1 << 5) /* TX FIFO at or below its trigger level */
+#define UART_INT_RT (1 << 6) /* Receive timeout, FIFO not empty but idle */
+#define UART_INT_OE (1 << 10)
+#define UART_INT_ALL 0x7FF
+
+/* PL190 interrupt controller. The OS IRQ handler address lives at 0x38, which
+ * the IRQ vector at 0x18 jumps through. */
+#define VIC_BASE 0xDC000000
+#define VIC_IRQ_STATUS (*(volatile unsigned *)(VIC_BASE + 0x00))
+#define VIC_INT_SELECT (*(volatile unsigned *)(VIC_BASE + 0x0C))
+#define VIC_INT_ENABLE (*(volatile unsigned *)(VIC_BASE + 0x10))
+#define VIC_INT_EN_CLEAR (*(volatile unsigned *)(VIC_BASE + 0x14))
+#define VIC_UART_IRQ (1 << 1)
+#define IRQ_HANDLER_ADDR (*(volatile unsigned *)0x38)
 
 #define UART_CLK 12000000
 #define BAUD_RATE 115200 /* See ESP32 sketch for baud rate reasoning */
 
+/* SP804 dual timer. We run the first half free at 32768 Hz, counting down
+ * from 0xFFFFFFFF, so it only wraps after 36 hours. */
+#define TIMER_BASE 0x900D0000
+#define TIMER_LOAD (*(volatile unsigned *)(TIMER_BASE + 0x00))
+#define TIMER_VALUE (*(volatile unsigned *)(TIMER_BASE + 0x04))
+#define TIMER_CONTROL (*(volatile unsigned *)(TIMER_BASE + 0x08))
+#define TIMER_CTRL_32BIT (1 << 1)
+#define TIMER_CTRL_ENABLE (1 << 7)
+#define TIMER_HZ 32768
+
+/* Keypad matrix, one 16-bit word per row. The keypad controller interrupts
+ * on every change, so key presses wake idle() too. */
+#define KEYPAD_DATA ((volatile unsigned short *)0x900E0010)
+#define KEYPAD_ROWS 8
+
+/* Ticks since timer_init(), kept in 64 bits so that the times below don't
+ * jump back when the counter wraps. Only needs calling once in 36 hours. */
+static unsigned long long timer_ticks(void) {
+  static unsigned last;
+  static unsigned long long total;
+  unsigned now = ~TIMER_VALUE;
+
+  total += now - last;
+  last = now;
+  return total;
+}
+
+/* Both wrap modulo 2^32, so (now - start) works across the wrap */
+static inline unsigned get_time_us(void) {
+  return timer_ticks() * 1000000 / TIMER_HZ;
+}
+
 static inline unsigned get_time_ms(void) {
-  return (*(volatile unsigned *)0x90090000) * 1000;
+  return timer_ticks() * 1000 / TIMER_HZ;
 }
 
 /* ============================================================================
@@ -49,22 +108,37 @@ static inline unsigned get_time_ms(void) {
 #define MAX_INPUT_LEN 256
 #define MAX_HISTORY_TURNS 20
 #define MAX_RESPONSE_LEN 16384
-#define SCROLLBACK_LINES 1000
+#define MAX_REQUEST_SIZE 8192 /* The ESP32's request buffer, see the sketch */
+#define SCROLLBACK_BYTES 49152 /* Message text, evicted oldest first */
+#define SCROLLBACK_MSGS 1024   /* Most messages held, a power of two */
+#define SCROLLBACK_MSG_MAX (SCROLLBACK_BYTES / 2)
+#define WRAP_CACHE 2         /* Messages with their row starts kept */
+#define WRAP_INDEX_ROWS 512  /* Row starts kept for each of those */
 #define CONSOLE_COLS NIO_MAX_COLS
 #define CONSOLE_ROWS NIO_MAX_ROWS
 /* Subtract 2 rows for bottom prompt bar. Other 8 work around a bug I don't
  * understand */
 #define VISIBLE_LINES (CONSOLE_ROWS - 10)
-#define EOT_CHAR 0x04
+#define MAX_QUEUED_PROMPTS 4 /* Typed while connecting or busy */
+#define RX_RING_SIZE 16384 /* Must be a power of two */
+#define TX_RING_SIZE 4096  /* Must be a power of two */
+#define FRAME_MS 33             /* Shortest time between paints */
+#define REDRAW_INTERVAL_MS 250 /* Longest a paint waits on incoming data */
+#define PAINT_BENCH_RUNS 8 /* Full repaints timed, with PAINT_BENCH */
+#define EVENT_TICK_MS 50 /* Longest sleep between main loop passes */
+#define KEY_REPEAT_DELAY_MS 400 /* Held scroll keys start repeating after */
+#define KEY_REPEAT_MS 50        /* and then repeat every */
 
 /* ============================================================================
  * Data Structures
  * ============================================================================
  */
 
+/* A turn is kept as the JSON object send_request() sends for it, escaped once
+ * when it is added */
 typedef struct {
-  char role[8];
-  char *content;
+  char *json;
+  int json_len;
 } ChatTurn;
 
 typedef struct {
@@ -72,12 +146,61 @@ typedef struct {
   int count;
 } ChatHistory;
 
+/* Background connection to the ESP32, advanced by conn_pump() */
+typedef enum {
+  CONN_PROBE,     /* Asking for STATUS at each rate it could be at */
+  CONN_SYNC,      /* Resumed or reset, sending SYNC until READY */
+  CONN_BAUD,      /* Sent BAUD for a faster rate, waiting for BAUD_OK */
+  CONN_BAUD_TEST, /* Switched, waiting for the test pattern */
+  CONN_BAUD_SYNC, /* Answered it with SYNC, waiting for READY */
+  CONN_BAUD_BACK, /* It failed, letting the ESP32 revert as well */
+  CONN_CAPS,      /* Sent CAPS, waiting for the answer */
+  CONN_UP,
+  CONN_FAILED,
+} ConnState;
+
+/* The request in flight, advanced by req_pump() from the main loop so the
+ * keyboard and screen stay live while the reply is awaited */
+typedef enum {
+  REQ_IDLE,
+  REQ_WAIT,    /* Sent, waiting for F_RESP or F_ERR */
+  REQ_RECEIVE, /* Reply arriving as F_CHUNK frames */
+} ReqState;
+
+/* Messages are kept as they were added, unwrapped, packed back to back in
+ * text and never straddling its end. start[] and len[] are a ring: message i
+ * of count, oldest first, is in slot (head + i) % SCROLLBACK_MSGS. Old
+ * messages go when their bytes or slot are needed. Wrapping them to screen
+ * rows is left to redraw(), which only does it for what it shows. */
 typedef struct {
-  char lines[SCROLLBACK_LINES][CONSOLE_COLS + 1];
-  int line_count;
-  int scroll_offset;
+  char text[SCROLLBACK_BYTES];
+  unsigned short start[SCROLLBACK_MSGS];
+  unsigned short len[SCROLLBACK_MSGS];
+  unsigned short rows[SCROLLBACK_MSGS]; /* Screen rows, 0 until wrapped */
+  int head;
+  int count;
+  unsigned total;    /* Messages ever added, numbers them across evictions */
+  int scroll_offset; /* Rows between the bottom of the view and the end */
+  bool at_top;       /* The view starts at the oldest row, set by redraw() */
 } ScrollBuffer;
 
+/* Where each screen row of a message starts, found on demand */
+typedef struct {
+  unsigned id; /* Message, numbered as in ScrollBuffer.total */
+  int len;     /* Its length when last looked at */
+  int count;   /* Row starts found, 0 if the entry is unused */
+  bool done;   /* They are all found */
+  unsigned short row[WRAP_INDEX_ROWS];
+} WrapIndex;
+
+/* Parts of the screen for redraw_parts() and paint() */
+enum {
+  DRAW_TEXT = 0x01,  /* Scrollback rows */
+  DRAW_BAR = 0x02,   /* Separator with the connection state */
+  DRAW_INPUT = 0x04, /* Prompt being typed */
+  DRAW_ALL = 0x07,
+};
+
 /* ============================================================================
  * Globals
  * ============================================================================
@@ -89,40 +212,232 @@ static ScrollBuffer scrollback;
 static char input_buffer[MAX_INPUT_LEN];
 static int input_len = 0;
 static unsigned os_ibrd, os_fbrd, os_lcr, os_cr;
+static unsigned os_timer_load, os_timer_control;
+static unsigned request_start; /* get_time_ms() when the request went out */
+static unsigned session_id;      /* ESP32 conversation session, from READY */
+static ConnState conn_state = CONN_PROBE;
+static int conn_rate;       /* Rate tried, -1 for BAUD_RATE or a candidate */
+static unsigned conn_since; /* get_time_ms() when the current step began */
+static unsigned conn_limit; /* How long the current step may take, in ms */
+static bool conn_resumed;   /* The ESP32 was healthy, no reset needed */
+static ReqState req_state = REQ_IDLE;
+static char *req_prompt, *req_response;
+static bool req_full;        /* The whole history went out with it */
+static bool req_counted;     /* The ESP32 added the prompt to its session */
+static unsigned req_since;   /* get_time_ms() when it last made progress */
+static unsigned req_dropped; /* rx_dropped when it was sent */
+static char *queued_prompts[MAX_QUEUED_PROMPTS];
+static int queued_count;
+static unsigned current_baud = BAUD_RATE;
+static bool link_error = false; /* Set when a transfer was corrupted */
+static bool link_compressed = false; /* Responses arrive LZ compressed */
+static bool link_compressed_upload = false; /* Requests go out compressed */
+static FrameParser rx_frame;
+static bool status_shown = false; /* Last scrollback line is a status line */
+static bool stream_active = false; /* Last message is still arriving */
+static WrapIndex wrap_cache[WRAP_CACHE];
+static char screen[CONSOLE_ROWS][CONSOLE_COLS]; /* What paint() last drew */
+static unsigned draw_pending; /* DRAW_ parts out of date */
+static unsigned paint_time;   /* get_time_ms() of the last paint */
+static int wrap_victim;
+
+/* Tried in order after READY. The PL011 runs off UART_CLK / 16, so 750000 is
+ * the ceiling and divides exactly. */
+static const unsigned baud_candidates[] = {750000, 460800, 230400};
+
+/* Filled by the UART interrupt, drained by the protocol code */
+static volatile unsigned char rx_ring[RX_RING_SIZE];
+static volatile unsigned rx_head, rx_tail;
+static volatile unsigned rx_dropped;
+static volatile unsigned char tx_ring[TX_RING_SIZE];
+static volatile unsigned tx_head, tx_tail;
+static volatile unsigned __attribute__((used)) os_irq_handler;
+static unsigned os_vic_enable, os_ifls;
+
+/* ============================================================================
+ * Timer
+ * ============================================================================
+ */
+
+static void timer_init(void) {
+  os_timer_load = TIMER_LOAD;
+  os_timer_control = TIMER_CONTROL;
+
+  TIMER_CONTROL = 0;
+  TIMER_LOAD = 0xFFFFFFFF;
+  TIMER_CONTROL = TIMER_CTRL_32BIT | TIMER_CTRL_ENABLE; /* Free running */
+}
+
+static void timer_restore(void) {
+  TIMER_CONTROL = 0;
+  TIMER_LOAD = os_timer_load;
+  TIMER_CONTROL = os_timer_control;
+}
 
 /* ============================================================================
  * UART Functions
  * ============================================================================
  */
 
-static void uart_init(void) {
+/* Move queued bytes into the TX FIFO until either runs out. Called by the IRQ
+ * handler while UART_INT_TX is unmasked, and by uart_tx_kick() otherwise. */
+static void uart_tx_fill(void) {
+  while (tx_tail != tx_head && !(UART_FR & UART_FR_TXFF)) {
+    UART_DR = tx_ring[tx_tail];
+    tx_tail = (tx_tail + 1) & (TX_RING_SIZE - 1);
+  }
+}
+
+/* Wait until everything queued has left the ring. The TX interrupt empties
+ * it, and wakes us each time it does some. */
+static void uart_tx_flush(void) {
+  while (tx_head != tx_tail)
+    idle();
+}
+
+static void uart_set_baud(unsigned rate) {
+  uart_tx_flush();
   while (!(UART_FR & UART_FR_TXFE))
     ;
   UART_CR = 0;
   while (UART_FR & UART_FR_BUSY)
     ;
 
-  unsigned divisor = (UART_CLK * 4) / BAUD_RATE;
+  /* 16.6 fixed point divisor of UART_CLK / (16 * rate), rounded */
+  unsigned divisor = (UART_CLK * 4 + rate / 2) / rate;
   UART_IBRD = divisor >> 6;
   UART_FBRD = divisor & 0x3F;
+  /* LCR_H write latches the new divisors */
   UART_LCR_H = UART_LCR_8BIT | UART_LCR_FEN;
   UART_CR = UART_CR_UARTEN | UART_CR_TXE | UART_CR_RXE;
 }
 
-static inline bool uart_has_data(void) { return uart_ready(); }
-static inline char uart_read_char(void) { return (char)UART_DR; }
+static void uart_init(void) { uart_set_baud(BAUD_RATE); }
+
+/* Called from uart_irq_entry in IRQ mode. Moves everything in the RX FIFO into
+ * rx_ring, refills the TX FIFO from tx_ring and returns nonzero if other
+ * interrupts still need the OS handler. */
+static unsigned __attribute__((used)) uart_irq_service(void) {
+  if (VIC_IRQ_STATUS & VIC_UART_IRQ) {
+    while (!(UART_FR & UART_FR_RXFE)) {
+      unsigned char c = UART_DR;
+      unsigned next = (rx_head + 1) & (RX_RING_SIZE - 1);
+      if (next != rx_tail) {
+        rx_ring[rx_head] = c;
+        rx_head = next;
+      } else {
+        rx_dropped++;
+      }
+    }
+    UART_ICR = UART_INT_RX | UART_INT_RT | UART_INT_OE;
+
+    if (UART_MIS & UART_INT_TX) {
+      uart_tx_fill();
+      if (tx_tail == tx_head)
+        UART_IMSC &= ~UART_INT_TX; /* uart_tx_kick() takes over again */
+    }
+  }
+  return VIC_IRQ_STATUS & ~VIC_UART_IRQ;
+}
+
+/* IRQ vector target. Services the UART, then either returns from the
+ * exception directly or tail-jumps into the OS handler with all registers
+ * (including the IRQ-mode lr) as they were on entry. */
+static void __attribute__((naked)) uart_irq_entry(void) {
+  __asm__ volatile("sub sp, sp, #4\n" /* Slot for the OS handler address */
+                   "stmfd sp!, {r0-r3, r12, lr}\n"
+                   "bl uart_irq_service\n"
+                   "cmp r0, #0\n"
+                   "bne 1f\n"
+                   "ldmfd sp!, {r0-r3, r12, lr}\n"
+                   "add sp, sp, #4\n"
+                   "subs pc, lr, #4\n"
+                   "1:\n"
+                   "ldr r0, 2f\n"
+                   "ldr r0, [r0]\n"
+                   "str r0, [sp, #24]\n"
+                   "ldmfd sp!, {r0-r3, r12, lr}\n"
+                   "ldmfd sp!, {pc}\n"
+                   "2: .word os_irq_handler\n");
+}
 
-static void uart_write_char(char c) {
-  while (UART_FR & UART_FR_TXFF)
-    ;
-  UART_DR = c;
+static void uart_irq_install(void) {
+  rx_head = rx_tail = 0;
+  rx_dropped = 0;
+  tx_head = tx_tail = 0;
+
+  UART_IMSC = 0;
+  UART_ICR = UART_INT_ALL;
+  os_ifls = UART_IFLS;
+  UART_IFLS = (os_ifls & ~0x3F) | UART_IFLS_RX_HALF | UART_IFLS_TX_HALF;
+
+  os_vic_enable = VIC_INT_ENABLE & VIC_UART_IRQ;
+  os_irq_handler = IRQ_HANDLER_ADDR;
+  IRQ_HANDLER_ADDR = (unsigned)uart_irq_entry;
+
+  VIC_INT_SELECT &= ~VIC_UART_IRQ;
+  VIC_INT_ENABLE = VIC_UART_IRQ;
+  UART_IMSC = UART_INT_RX | UART_INT_RT | UART_INT_OE;
+}
+
+static void uart_irq_remove(void) {
+  uart_tx_flush();
+  UART_IMSC = 0;
+  UART_ICR = UART_INT_ALL;
+  if (!os_vic_enable)
+    VIC_INT_EN_CLEAR = VIC_UART_IRQ;
+  IRQ_HANDLER_ADDR = os_irq_handler;
+  UART_IFLS = os_ifls;
 }
 
-static void uart_write_str(const char *s) {
-  while (*s)
-    uart_write_char(*s++);
+static inline bool uart_has_data(void) { return rx_head != rx_tail; }
+
+static inline char uart_read_char(void) {
+  char c = rx_ring[rx_tail];
+  rx_tail = (rx_tail + 1) & (RX_RING_SIZE - 1);
+  return c;
+}
+
+/* Start the TX FIFO on queued bytes if the IRQ handler isn't already feeding
+ * it. The handler only touches IMSC while UART_INT_TX is unmasked, so the
+ * read-modify-write here can't race it. */
+static void uart_tx_kick(void) {
+  if (!(UART_IMSC & UART_INT_TX)) {
+    uart_tx_fill();
+    /* The FIFO is full if anything is left, so the interrupt will fire once
+     * it drains below the trigger level */
+    if (tx_tail != tx_head)
+      UART_IMSC |= UART_INT_TX;
+  }
 }
 
+/* Queue bytes for sending. Only blocks while the ring is full. */
+static void uart_write(const void *data, int len) {
+  const unsigned char *p = data;
+
+  while (len > 0) {
+    unsigned space = (tx_tail - tx_head - 1) & (TX_RING_SIZE - 1);
+    if (space == 0) {
+      uart_tx_kick();
+      idle();
+      continue;
+    }
+
+    unsigned head = tx_head;
+    if (space > (unsigned)len)
+      space = len;
+    len -= space;
+    while (space--) {
+      tx_ring[head] = *p++;
+      head = (head + 1) & (TX_RING_SIZE - 1);
+    }
+    tx_head = head;
+  }
+  uart_tx_kick();
+}
+
+static void uart_write_str(const char *s) { uart_write(s, strlen(s)); }
+
 static void uart_drain(unsigned ms) {
   unsigned start = get_time_ms();
   while ((get_time_ms() - start) < ms) {
@@ -137,159 +452,926 @@ static void uart_drain(unsigned ms) {
  * ============================================================================
  */
 
-static bool uart_handshake(void) {
-  nio_printf("Connecting to ESP32...\n");
+static void link_send(unsigned char type, const void *payload, int len) {
+  unsigned char frame[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+  uart_write(frame, frame_encode(frame, type, payload, len));
+}
 
-  uart_drain(100);
+/* Send a line to the ESP32's serial log */
+static void link_log(const char *fmt, ...) {
+  char buf[FRAME_MAX_PAYLOAD + 1];
+  va_list ap;
+
+  va_start(ap, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (len > FRAME_MAX_PAYLOAD)
+    len = FRAME_MAX_PAYLOAD;
+  if (len > 0)
+    link_send(F_LOG, buf, len);
+}
 
-  /* Send wake bytes to wake ESP32 from sleep */
-  uart_write_str("\n\n\n\n\n");
+/* Feed received bytes to the parser until a frame completes. Returns FRAME_OK
+ * with the frame in rx_frame, FRAME_BAD if one failed its CRC or was cut
+ * short, or FRAME_NONE once the ring is empty. */
+static int link_poll(void) {
+  static unsigned last_byte; /* get_time_ms() when one was last read */
+  int r = frame_parse_pending(&rx_frame);
 
-  /* Wait for AWAKE response (if ESP32 was sleeping) or ESP_READY (if not) */
-  char buf[32];
-  int idx = 0;
+  while (r == FRAME_NONE && uart_has_data()) {
+    r = frame_parse(&rx_frame, uart_read_char());
+    last_byte = get_time_ms();
+  }
+  if (r == FRAME_NONE && (get_time_ms() - last_byte) >= FRAME_IDLE_MS)
+    r = frame_parse_idle(&rx_frame);
+  return r;
+}
+
+/* Wait for a frame of the given type, ignoring any others. Sleeps whenever
+ * rx_ring runs dry, until the UART or timer interrupt wakes us. */
+static bool link_wait(unsigned char type, unsigned timeout_ms) {
   unsigned start = get_time_ms();
 
-  while ((get_time_ms() - start) < 2000) {
-    if (uart_has_data()) {
-      char c = uart_read_char();
-      if (c == '\n') {
-        buf[idx] = '\0';
-        if (strcmp(buf, "AWAKE") == 0 || strcmp(buf, "ESP_READY") == 0) {
-          break;
-        }
-        idx = 0;
-      } else if (c != '\r' && idx < 31) {
-        buf[idx++] = c;
+  while ((get_time_ms() - start) < timeout_ms) {
+    int r = link_poll();
+    if (r == FRAME_OK && rx_frame.type == type)
+      return true;
+    if (r == FRAME_NONE)
+      idle();
+  }
+  return false;
+}
+
+/* Push the ESP32's parser out of whatever half frame it thinks it is in.
+ * Zeros can't start a frame, and this many complete even the longest. */
+static void link_resync(void) {
+  static const unsigned char zeros[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+  uart_write(zeros, sizeof(zeros));
+}
+
+/* Tell the ESP32 to abandon the current request and wait for its echo, after
+ * which nothing more from that request can arrive */
+static void link_cancel(void) {
+  link_send(F_CANCEL, NULL, 0);
+  if (!link_wait(F_CANCEL, 5000))
+    uart_drain(100);
+}
+
+/* Whether rx_frame is the test pattern the ESP32 sends at a new rate */
+static bool baud_test_ok(void) {
+  return rx_frame.type == F_BAUD_TEST &&
+         rx_frame.len == sizeof(LINK_BAUD_TEST) - 1 &&
+         memcmp(rx_frame.payload, LINK_BAUD_TEST, rx_frame.len) == 0;
+}
+
+/* Switch to rate and see whether the ESP32 answers there. SYNC only gets
+ * READY back, where STATUS would start a new conversation. */
+static bool uart_try_baud(unsigned rate) {
+  uart_set_baud(rate);
+  current_baud = rate;
+  frame_parser_init(&rx_frame);
+  link_resync();
+  link_send(F_SYNC, NULL, 0);
+  return link_wait(F_READY, 250);
+}
+
+/* Ask the ESP32 to switch to a new baud rate. After BAUD_OK both sides switch,
+ * the ESP32 sends the test pattern at the new rate and we answer with SYNC.
+ * If anything is missing both sides drop back to BAUD_RATE on their own.
+ * This blocks, so it is only used for going back to BAUD_RATE, which is quick
+ * unless the link is already in trouble. conn_pump() raises the rate. */
+static bool uart_negotiate_baud(unsigned rate) {
+  unsigned char payload[4];
+  unsigned from = current_baud;
+
+  frame_put_u32(payload, rate);
+  link_send(F_BAUD, payload, 4);
+  if (link_wait(F_BAUD_OK, 500)) {
+    uart_set_baud(rate);
+    frame_parser_init(&rx_frame);
+    if (link_wait(F_BAUD_TEST, 500) && baud_test_ok()) {
+      link_send(F_SYNC, NULL, 0);
+      if (link_wait(F_READY, 500)) {
+        current_baud = rate;
+        return true;
       }
     }
   }
 
-  uart_write_str("RST\n");
+  /* Give the ESP32 time to notice and revert too */
+  uart_set_baud(BAUD_RATE);
+  frame_parser_init(&rx_frame);
+  current_baud = BAUD_RATE;
+  uart_drain(600);
+
+  /* Unless the BAUD never reached it, in which case it is still where we
+   * started. That only matters when we started somewhere else, so ask at
+   * both rates much as conn_probe() does. */
+  if (from != BAUD_RATE && !uart_try_baud(BAUD_RATE) &&
+      !uart_try_baud(from)) {
+    uart_set_baud(BAUD_RATE);
+    current_baud = BAUD_RATE;
+  }
+  return false;
+}
 
-  idx = 0;
-  start = get_time_ms();
+/* The connection comes up in the background while the user types:
+ *
+ *   CONN_PROBE  STATUS at BAUD_RATE, then at every rate an earlier session
+ *               could have left the ESP32 at. A healthy answer skips the
+ *               reset, so the ESP32 keeps its wireless connection.
+ *   CONN_SYNC   After a resume, or RST at every rate, SYNC is sent (again
+ *               on each HELLO) until READY arrives.
+ *   CONN_BAUD   BAUD for each faster rate in turn, as uart_negotiate_baud()
+ *               does, until one holds up. Skipped if the ESP32 was found at
+ *               a faster rate already.
+ *   CONN_CAPS   Optional features, then CONN_UP.
+ */
 
-  /* Wait for ESP_READY */
-  while ((get_time_ms() - start) < 15000) {
-    if (isKeyPressed(KEY_NSPIRE_ESC))
-      return false;
+/* Move on to the next step, which may take up to limit_ms */
+static void conn_step(ConnState state, unsigned limit_ms) {
+  conn_state = state;
+  conn_since = get_time_ms();
+  conn_limit = limit_ms;
+}
 
-    if (uart_has_data()) {
-      char c = uart_read_char();
-      if (c == '\n') {
-        buf[idx] = '\0';
-        if (strcmp(buf, "ESP_READY") == 0)
-          break;
-        idx = 0;
-      } else if (c != '\r' && idx < 31) {
-        buf[idx++] = c;
+static bool conn_timed_out(void) {
+  return (get_time_ms() - conn_since) >= conn_limit;
+}
+
+static void conn_probe(int rate_index) {
+  unsigned rate = rate_index < 0 ? BAUD_RATE : baud_candidates[rate_index];
+
+  /* Most of the time it is at BAUD_RATE, so give that long enough for an
+   * ESP32 waking from light sleep to announce itself */
+  conn_step(CONN_PROBE, rate_index < 0 ? 2000 : 250);
+  conn_rate = rate_index;
+  uart_set_baud(rate);
+  current_baud = rate;
+  frame_parser_init(&rx_frame);
+  link_resync();
+  link_send(F_STATUS, NULL, 0);
+}
+
+static void conn_reset(void) {
+  for (unsigned i = 0; i < sizeof(baud_candidates) / sizeof(baud_candidates[0]);
+       i++) {
+    uart_set_baud(baud_candidates[i]);
+    link_resync();
+    link_send(F_RST, NULL, 0);
+  }
+  uart_set_baud(BAUD_RATE);
+  current_baud = BAUD_RATE;
+  link_resync();
+  link_send(F_RST, NULL, 0);
+  frame_parser_init(&rx_frame);
+  conn_step(CONN_SYNC, 15000);
+}
+
+static void conn_start(void) {
+  /* Send wake bytes to wake ESP32 from sleep. They aren't part of a frame,
+   * so an ESP32 that is already awake ignores them. */
+  uart_write_str("\n\n\n\n\n");
+  conn_resumed = false;
+  conn_probe(-1);
+}
+
+/* Offer optional protocol features, the ESP32 answers with the subset it will
+ * actually use */
+static void conn_caps(void) {
+  unsigned char wanted = CAP_LZ | CAP_LZUP;
+
+  link_compressed = link_compressed_upload = false;
+  link_send(F_CAPS, &wanted, 1);
+  conn_step(CONN_CAPS, 500);
+}
+
+static void conn_baud(int rate_index) {
+  unsigned char payload[4];
+
+  conn_rate = rate_index;
+  frame_put_u32(payload, baud_candidates[rate_index]);
+  link_send(F_BAUD, payload, 4);
+  conn_step(CONN_BAUD, 500);
+}
+
+/* The rate didn't hold up. Go back to BAUD_RATE and give the ESP32 time to
+ * notice and revert too before trying the next. */
+static void conn_baud_failed(void) {
+  uart_set_baud(BAUD_RATE);
+  frame_parser_init(&rx_frame);
+  current_baud = BAUD_RATE;
+  conn_step(CONN_BAUD_BACK, 600);
+}
+
+static void conn_ready(void) {
+  if (rx_frame.len >= 4)
+    session_id = frame_get_u32(rx_frame.payload);
+
+  /* A resumed ESP32 found at a faster rate can stay there */
+  if (current_baud == BAUD_RATE)
+    conn_baud(0);
+  else
+    conn_caps();
+}
+
+/* Advance the connection with whatever has arrived. Returns true when it
+ * comes up or fails. */
+static bool conn_pump(void) {
+  int r;
+
+  switch (conn_state) {
+  case CONN_PROBE:
+    while ((r = link_poll()) != FRAME_NONE) {
+      if (r != FRAME_OK)
+        continue;
+      if (rx_frame.type == F_STATUS) {
+        if (rx_frame.len >= 1 && (rx_frame.payload[0] & STATUS_WIFI)) {
+          conn_resumed = true;
+          conn_step(CONN_SYNC, 15000);
+          link_send(F_SYNC, NULL, 0);
+        } else {
+          conn_reset();
+        }
+        return false;
       }
+      /* It just woke up or booted and missed the first one. After waking
+       * it reconnects to WiFi, for up to 10 s, before it answers. */
+      if (rx_frame.type == F_AWAKE || rx_frame.type == F_HELLO)
+        link_send(F_STATUS, NULL, 0);
+      if (rx_frame.type == F_AWAKE)
+        conn_step(CONN_PROBE, 12000);
     }
-    idle();
+
+    if (conn_timed_out()) {
+      if (conn_rate + 1 <
+          (int)(sizeof(baud_candidates) / sizeof(baud_candidates[0])))
+        conn_probe(conn_rate + 1);
+      else
+        conn_reset();
+    }
+    return false;
+
+  case CONN_SYNC:
+    while ((r = link_poll()) != FRAME_NONE) {
+      if (r == FRAME_OK && rx_frame.type == F_HELLO) {
+        link_send(F_SYNC, NULL, 0);
+      } else if (r == FRAME_OK && rx_frame.type == F_READY) {
+        conn_ready();
+        return false;
+      }
+    }
+    if (conn_timed_out()) {
+      conn_state = CONN_FAILED;
+      return true;
+    }
+    return false;
+
+  case CONN_BAUD:
+    while ((r = link_poll()) != FRAME_NONE) {
+      if (r == FRAME_OK && rx_frame.type == F_BAUD_OK) {
+        uart_set_baud(baud_candidates[conn_rate]);
+        frame_parser_init(&rx_frame);
+        conn_step(CONN_BAUD_TEST, 500);
+        return false;
+      }
+    }
+    if (conn_timed_out())
+      conn_baud_failed();
+    return false;
+
+  case CONN_BAUD_TEST:
+    while ((r = link_poll()) != FRAME_NONE) {
+      if (r == FRAME_OK && baud_test_ok()) {
+        link_send(F_SYNC, NULL, 0);
+        conn_step(CONN_BAUD_SYNC, 500);
+        return false;
+      }
+    }
+    if (conn_timed_out())
+      conn_baud_failed();
+    return false;
+
+  case CONN_BAUD_SYNC:
+    while ((r = link_poll()) != FRAME_NONE) {
+      if (r == FRAME_OK && rx_frame.type == F_READY) {
+        current_baud = baud_candidates[conn_rate];
+        conn_caps();
+        return false;
+      }
+    }
+    if (conn_timed_out())
+      conn_baud_failed();
+    return false;
+
+  case CONN_BAUD_BACK:
+    while (link_poll() != FRAME_NONE)
+      ;
+    if (conn_timed_out()) {
+      if (conn_rate + 1 <
+          (int)(sizeof(baud_candidates) / sizeof(baud_candidates[0])))
+        conn_baud(conn_rate + 1);
+      else
+        conn_caps();
+    }
+    return false;
+
+  case CONN_CAPS:
+    while ((r = link_poll()) != FRAME_NONE) {
+      if (r == FRAME_OK && rx_frame.type == F_CAPS && rx_frame.len >= 1) {
+        link_compressed = rx_frame.payload[0] & CAP_LZ;
+        link_compressed_upload = rx_frame.payload[0] & CAP_LZUP;
+        conn_state = CONN_UP;
+        return true;
+      }
+    }
+    if (conn_timed_out()) {
+      conn_state = CONN_UP;
+      return true;
+    }
+    return false;
+
+  default:
+    return false;
   }
+}
+
+#ifdef FB_RENDER
+/* ============================================================================
+ * Framebuffer
+ * ============================================================================
+ */
 
-  /* Send SYNC and wait for READY */
-  uart_drain(50);
-  uart_write_str("SYNC\n");
+/* Built with FRAMEBUFFER=TRUE. Text is drawn into an off-screen 320x240
+ * RGB565 buffer, which goes to the LCD in one lcd_blit() per redraw,
+ * instead of through the nspireio console a glyph at a time. Cells are the
+ * console's 6x8, so the layout is the same either way. */
+#define FB_WIDTH 320
+#define FB_HEIGHT 240
+#define GLYPH_W 6
+#define GLYPH_H 8
+#define FONT_GLYPHS 95 /* ' ' to '~' */
+#define FB_FG 0xFFFF
+#define FB_BG 0x0000
+
+/* 5x7 glyphs, one byte per column with bit 0 at the top. The sixth column
+ * and eighth row of each cell are spacing. */
+static const unsigned char font5x7[FONT_GLYPHS][5] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, /* space */
+    {0x00, 0x00, 0x5F, 0x00, 0x00}, /* ! */
+    {0x00, 0x07, 0x00, 0x07, 0x00}, /* " */
+    {0x14, 0x7F, 0x14, 0x7F, 0x14}, /* # */
+    {0x24, 0x2A, 0x7F, 0x2A, 0x12}, /* $ */
+    {0x23, 0x13, 0x08, 0x64, 0x62}, /* % */
+    {0x36, 0x49, 0x55, 0x22, 0x50}, /* & */
+    {0x00, 0x05, 0x03, 0x00, 0x00}, /* ' */
+    {0x00, 0x1C, 0x22, 0x41, 0x00}, /* ( */
+    {0x00, 0x41, 0x22, 0x1C, 0x00}, /* ) */
+    {0x14, 0x08, 0x3E, 0x08, 0x14}, /* * */
+    {0x08, 0x08, 0x3E, 0x08, 0x08}, /* + */
+    {0x00, 0x50, 0x30, 0x00, 0x00}, /* , */
+    {0x08, 0x08, 0x08, 0x08, 0x08}, /* - */
+    {0x00, 0x60, 0x60, 0x00, 0x00}, /* . */
+    {0x20, 0x10, 0x08, 0x04, 0x02}, /* / */
+    {0x3E, 0x51, 0x49, 0x45, 0x3E}, /* 0 */
+    {0x00, 0x42, 0x7F, 0x40, 0x00}, /* 1 */
+    {0x42, 0x61, 0x51, 0x49, 0x46}, /* 2 */
+    {0x21, 0x41, 0x45, 0x4B, 0x31}, /* 3 */
+    {0x18, 0x14, 0x12, 0x7F, 0x10}, /* 4 */
+    {0x27, 0x45, 0x45, 0x45, 0x39}, /* 5 */
+    {0x3C, 0x4A, 0x49, 0x49, 0x30}, /* 6 */
+    {0x01, 0x71, 0x09, 0x05, 0x03}, /* 7 */
+    {0x36, 0x49, 0x49, 0x49, 0x36}, /* 8 */
+    {0x06, 0x49, 0x49, 0x29, 0x1E}, /* 9 */
+    {0x00, 0x36, 0x36, 0x00, 0x00}, /* : */
+    {0x00, 0x56, 0x36, 0x00, 0x00}, /* ; */
+    {0x08, 0x14, 0x22, 0x41, 0x00}, /* < */
+    {0x14, 0x14, 0x14, 0x14, 0x14}, /* = */
+    {0x00, 0x41, 0x22, 0x14, 0x08}, /* > */
+    {0x02, 0x01, 0x51, 0x09, 0x06}, /* ? */
+    {0x32, 0x49, 0x79, 0x41, 0x3E}, /* @ */
+    {0x7E, 0x11, 0x11, 0x11, 0x7E}, /* A */
+    {0x7F, 0x49, 0x49, 0x49, 0x36}, /* B */
+    {0x3E, 0x41, 0x41, 0x41, 0x22}, /* C */
+    {0x7F, 0x41, 0x41, 0x22, 0x1C}, /* D */
+    {0x7F, 0x49, 0x49, 0x49, 0x41}, /* E */
+    {0x7F, 0x09, 0x09, 0x09, 0x01}, /* F */
+    {0x3E, 0x41, 0x49, 0x49, 0x7A}, /* G */
+    {0x7F, 0x08, 0x08, 0x08, 0x7F}, /* H */
+    {0x00, 0x41, 0x7F, 0x41, 0x00}, /* I */
+    {0x20, 0x40, 0x41, 0x3F, 0x01}, /* J */
+    {0x7F, 0x08, 0x14, 0x22, 0x41}, /* K */
+    {0x7F, 0x40, 0x40, 0x40, 0x40}, /* L */
+    {0x7F, 0x02, 0x0C, 0x02, 0x7F}, /* M */
+    {0x7F, 0x04, 0x08, 0x10, 0x7F}, /* N */
+    {0x3E, 0x41, 0x41, 0x41, 0x3E}, /* O */
+    {0x7F, 0x09, 0x09, 0x09, 0x06}, /* P */
+    {0x3E, 0x41, 0x51, 0x21, 0x5E}, /* Q */
+    {0x7F, 0x09, 0x19, 0x29, 0x46}, /* R */
+    {0x46, 0x49, 0x49, 0x49, 0x31}, /* S */
+    {0x01, 0x01, 0x7F, 0x01, 0x01}, /* T */
+    {0x3F, 0x40, 0x40, 0x40, 0x3F}, /* U */
+    {0x1F, 0x20, 0x40, 0x20, 0x1F}, /* V */
+    {0x3F, 0x40, 0x38, 0x40, 0x3F}, /* W */
+    {0x63, 0x14, 0x08, 0x14, 0x63}, /* X */
+    {0x07, 0x08, 0x70, 0x08, 0x07}, /* Y */
+    {0x61, 0x51, 0x49, 0x45, 0x43}, /* Z */
+    {0x00, 0x7F, 0x41, 0x41, 0x00}, /* [ */
+    {0x02, 0x04, 0x08, 0x10, 0x20}, /* \ */
+    {0x00, 0x41, 0x41, 0x7F, 0x00}, /* ] */
+    {0x04, 0x02, 0x01, 0x02, 0x04}, /* ^ */
+    {0x40, 0x40, 0x40, 0x40, 0x40}, /* _ */
+    {0x00, 0x01, 0x02, 0x04, 0x00}, /* ` */
+    {0x20, 0x54, 0x54, 0x54, 0x78}, /* a */
+    {0x7F, 0x48, 0x44, 0x44, 0x38}, /* b */
+    {0x38, 0x44, 0x44, 0x44, 0x20}, /* c */
+    {0x38, 0x44, 0x44, 0x48, 0x7F}, /* d */
+    {0x38, 0x54, 0x54, 0x54, 0x18}, /* e */
+    {0x08, 0x7E, 0x09, 0x01, 0x02}, /* f */
+    {0x0C, 0x52, 0x52, 0x52, 0x3E}, /* g */
+    {0x7F, 0x08, 0x04, 0x04, 0x78}, /* h */
+    {0x00, 0x44, 0x7D, 0x40, 0x00}, /* i */
+    {0x20, 0x40, 0x44, 0x3D, 0x00}, /* j */
+    {0x7F, 0x10, 0x28, 0x44, 0x00}, /* k */
+    {0x00, 0x41, 0x7F, 0x40, 0x00}, /* l */
+    {0x7C, 0x04, 0x18, 0x04, 0x78}, /* m */
+    {0x7C, 0x08, 0x04, 0x04, 0x78}, /* n */
+    {0x38, 0x44, 0x44, 0x44, 0x38}, /* o */
+    {0x7C, 0x14, 0x14, 0x14, 0x08}, /* p */
+    {0x08, 0x14, 0x14, 0x18, 0x7C}, /* q */
+    {0x7C, 0x08, 0x04, 0x04, 0x08}, /* r */
+    {0x48, 0x54, 0x54, 0x54, 0x20}, /* s */
+    {0x04, 0x3F, 0x44, 0x40, 0x20}, /* t */
+    {0x3C, 0x40, 0x40, 0x20, 0x7C}, /* u */
+    {0x1C, 0x20, 0x40, 0x20, 0x1C}, /* v */
+    {0x3C, 0x40, 0x30, 0x40, 0x3C}, /* w */
+    {0x44, 0x28, 0x10, 0x28, 0x44}, /* x */
+    {0x0C, 0x50, 0x50, 0x50, 0x3C}, /* y */
+    {0x44, 0x64, 0x54, 0x4C, 0x44}, /* z */
+    {0x00, 0x08, 0x36, 0x41, 0x00}, /* { */
+    {0x00, 0x00, 0x7F, 0x00, 0x00}, /* | */
+    {0x00, 0x41, 0x36, 0x08, 0x00}, /* } */
+    {0x08, 0x04, 0x08, 0x10, 0x08}, /* ~ */
+};
 
-  idx = 0;
-  start = get_time_ms();
+static unsigned short *fb;
+static bool fb_dirty;
 
-  while ((get_time_ms() - start) < 5000) {
-    if (uart_has_data()) {
-      char c = uart_read_char();
-      if (c == '\n') {
-        buf[idx] = '\0';
-        if (strcmp(buf, "READY") == 0) {
-          nio_printf("Connected!\n");
-          return true;
-        }
-        idx = 0;
-      } else if (c != '\r' && idx < 31) {
-        buf[idx++] = c;
+/* Every glyph already expanded to FB_FG and FB_BG pixels, so a cell is
+ * drawn with eight row copies */
+static unsigned short glyph_px[FONT_GLYPHS][GLYPH_H][GLYPH_W];
+
+static bool fb_init(void) {
+  fb = malloc(FB_WIDTH * FB_HEIGHT * sizeof(*fb));
+  if (!fb)
+    return false;
+  if (!lcd_init(SCR_320x240_565)) {
+    free(fb);
+    return false;
+  }
+
+  for (int g = 0; g < FONT_GLYPHS; g++) {
+    for (int r = 0; r < GLYPH_H; r++) {
+      for (int c = 0; c < GLYPH_W; c++) {
+        bool on = c < 5 && (font5x7[g][c] >> r) & 1;
+        glyph_px[g][r][c] = on ? FB_FG : FB_BG;
       }
     }
-    idle();
   }
 
-  nio_printf("Connection failed.\n");
-  return false;
+  for (int i = 0; i < FB_WIDTH * FB_HEIGHT; i++)
+    fb[i] = FB_BG;
+  lcd_blit(fb, SCR_320x240_565);
+  return true;
 }
 
+static void fb_free(void) {
+  lcd_init(SCR_TYPE_INVALID); /* Back to what the OS had */
+  free(fb);
+}
+
+static void fb_drawchar(char ch, int x, int y) {
+  unsigned g = (unsigned char)ch - ' ';
+  if (g >= FONT_GLYPHS)
+    g = '?' - ' ';
+
+  unsigned short *dst = fb + y * GLYPH_H * FB_WIDTH + x * GLYPH_W;
+  for (int r = 0; r < GLYPH_H; r++, dst += FB_WIDTH)
+    memcpy(dst, glyph_px[g][r], sizeof(glyph_px[g][r]));
+  fb_dirty = true;
+}
+
+/* Push the buffer to the LCD if anything was drawn since the last time */
+static void fb_flush(void) {
+  if (fb_dirty) {
+    lcd_blit(fb, SCR_320x240_565);
+    fb_dirty = false;
+  }
+}
+#else
+static bool nio_dirty; /* Cells drawn since the last nio_fflush() */
+#endif
+
 /* ============================================================================
  * Display Functions
  * ============================================================================
  */
 
-static void scroll_add_line(const char *line) {
-  if (scrollback.line_count < SCROLLBACK_LINES) {
-    strncpy(scrollback.lines[scrollback.line_count], line, CONSOLE_COLS);
-    scrollback.lines[scrollback.line_count][CONSOLE_COLS] = '\0';
-    scrollback.line_count++;
+static int scroll_slot(int i) {
+  return (scrollback.head + i) & (SCROLLBACK_MSGS - 1);
+}
+
+/* Message i of the scrollback, 0 being the oldest still held */
+static const char *scroll_text(int i) {
+  return scrollback.text + scrollback.start[scroll_slot(i)];
+}
+
+static int scroll_len(int i) { return scrollback.len[scroll_slot(i)]; }
+
+/* Drop the oldest messages while any of them starts in [pos, end), keeping
+ * at least the newest keep. Messages are laid out in the order they were
+ * added, so the oldest is always the next one past the free space. */
+static void scroll_evict(int pos, int end, int keep) {
+  while (scrollback.count > keep) {
+    int oldest = scrollback.start[scrollback.head];
+    if (oldest < pos || oldest >= end)
+      break;
+    scrollback.head = (scrollback.head + 1) & (SCROLLBACK_MSGS - 1);
+    scrollback.count--;
+  }
+}
+
+/* Extend the last message in place, moving it to the start of the arena if
+ * it would run past the end */
+static void scroll_append(const char *text, int len) {
+  int slot = scroll_slot(scrollback.count - 1);
+  int start = scrollback.start[slot];
+  int cur = scrollback.len[slot];
+
+  if (len > SCROLLBACK_MSG_MAX - cur)
+    len = SCROLLBACK_MSG_MAX - cur;
+  if (len <= 0)
+    return;
+
+  if (start + cur + len > SCROLLBACK_BYTES) {
+    /* Anything still in the end it skips is from the last lap. It can't
+     * overlap itself at the start, as it is at most half the arena. */
+    scroll_evict(start + cur, SCROLLBACK_BYTES, 1);
+    scroll_evict(0, cur + len, 1);
+    memmove(scrollback.text, scrollback.text + start, cur);
+    scrollback.start[slot] = start = 0;
   } else {
-    memmove(scrollback.lines[0], scrollback.lines[1],
-            (SCROLLBACK_LINES - 1) * (CONSOLE_COLS + 1));
-    strncpy(scrollback.lines[SCROLLBACK_LINES - 1], line, CONSOLE_COLS);
-    scrollback.lines[SCROLLBACK_LINES - 1][CONSOLE_COLS] = '\0';
+    scroll_evict(start + cur, start + cur + len, 1);
+  }
+  memcpy(scrollback.text + start + cur, text, len);
+  scrollback.len[slot] = cur + len;
+  scrollback.rows[slot] = 0;
+}
+
+static void scroll_add_line(const char *line) {
+  int pos = 0;
+
+  if (scrollback.count > 0) {
+    int last = scroll_slot(scrollback.count - 1);
+    pos = scrollback.start[last] + scrollback.len[last];
+  }
+  if (scrollback.count == SCROLLBACK_MSGS) {
+    scrollback.head = (scrollback.head + 1) & (SCROLLBACK_MSGS - 1);
+    scrollback.count--;
+  }
+
+  int slot = scroll_slot(scrollback.count++);
+  scrollback.start[slot] = pos < SCROLLBACK_BYTES ? pos : 0;
+  scrollback.len[slot] = 0;
+  scrollback.rows[slot] = 0;
+  scrollback.total++;
+  scroll_append(line, strlen(line));
+}
+
+/* Take back the message added last */
+static void scroll_remove_line(void) {
+  scrollback.count--;
+  scrollback.total--;
+
+  /* Its number will be reused */
+  for (int i = 0; i < WRAP_CACHE; i++) {
+    if (wrap_cache[i].id == scrollback.total)
+      wrap_cache[i].count = 0;
   }
 }
 
 static void scroll_add_text(const char *prefix, const char *text) {
-  char line[CONSOLE_COLS + 1];
-  int col = 0;
+  scroll_add_line(prefix ? prefix : "");
+  scroll_append(text, strlen(text));
+}
 
-  if (prefix) {
-    int plen = strlen(prefix);
-    if (plen > CONSOLE_COLS)
-      plen = CONSOLE_COLS;
-    memcpy(line, prefix, plen);
-    col = plen;
+/* Find the end of the row starting at s, with len characters left in the
+ * message. Rows break at a newline, else at the last space that lets them
+ * fit, else mid-word. Sets *shown to how many characters to draw and
+ * returns where the next row starts. */
+static int wrap_next(const char *s, int len, int *shown) {
+  int n = len < CONSOLE_COLS ? len : CONSOLE_COLS;
+
+  for (int i = 0; i < n; i++) {
+    if (s[i] == '\n') {
+      *shown = i;
+      return i + 1;
+    }
+  }
+  if (len <= CONSOLE_COLS) {
+    *shown = len;
+    return len;
   }
 
-  while (*text) {
-    if (*text == '\n' || col >= CONSOLE_COLS) {
-      line[col] = '\0';
-      scroll_add_line(line);
-      col = 0;
-      if (*text == '\n')
-        text++;
-    } else {
-      line[col++] = *text++;
+  /* A full row swallows the break right after it */
+  *shown = CONSOLE_COLS;
+  if (s[CONSOLE_COLS] == '\n' || s[CONSOLE_COLS] == ' ')
+    return CONSOLE_COLS + 1;
+  for (int i = CONSOLE_COLS - 1; i > 0; i--) {
+    if (s[i] == ' ') {
+      *shown = i;
+      return i + 1;
     }
   }
+  return CONSOLE_COLS;
+}
 
-  if (col > 0) {
-    line[col] = '\0';
-    scroll_add_line(line);
+/* Row starts of message i, found as far as they have been asked for. The
+ * last message may still be growing, but text is only ever added to its
+ * end, so only the rows whose break could have moved are found again. */
+static WrapIndex *wrap_index(int i) {
+  unsigned id = scrollback.total - scrollback.count + i;
+  int len = scroll_len(i);
+  WrapIndex *w = NULL;
+
+  for (int k = 0; k < WRAP_CACHE; k++) {
+    if (wrap_cache[k].count > 0 && wrap_cache[k].id == id)
+      w = &wrap_cache[k];
   }
+  if (!w) {
+    w = &wrap_cache[wrap_victim];
+    wrap_victim = (wrap_victim + 1) % WRAP_CACHE;
+    w->id = id;
+    w->len = len;
+    w->count = 1;
+    w->row[0] = 0;
+    w->done = false;
+  } else if (w->len != len) {
+    /* A break is final once the space after a full row had arrived */
+    while (w->count > 1 && w->row[w->count - 2] + CONSOLE_COLS >= w->len)
+      w->count--;
+    w->len = len;
+    w->done = false;
+  }
+  return w;
 }
 
-static void redraw(void) {
-  /* Don't draw to screen while updating it to prevent flicker */
-  nio_drawing_enabled(&csl, false);
+/* Where row r of message i starts */
+static int wrap_row(int i, int r) {
+  WrapIndex *w = wrap_index(i);
+  const char *s = scroll_text(i);
+  int shown, pos;
+
+  while (!w->done && w->count <= r && w->count < WRAP_INDEX_ROWS) {
+    pos = w->row[w->count - 1];
+    pos += wrap_next(s + pos, w->len - pos, &shown);
+    if (pos >= w->len)
+      w->done = true;
+    else
+      w->row[w->count++] = pos;
+  }
+  if (r < w->count)
+    return w->row[r];
+
+  /* Past what the index holds, walk on from its end */
+  pos = w->row[w->count - 1];
+  for (int k = w->count - 1; k < r && pos < w->len; k++)
+    pos += wrap_next(s + pos, w->len - pos, &shown);
+  return pos;
+}
 
-  nio_clear(&csl);
+/* How many screen rows message i takes */
+static int scroll_rows(int i) {
+  int slot = scroll_slot(i);
+
+  if (!scrollback.rows[slot]) {
+    WrapIndex *w = wrap_index(i);
+    int rows;
+
+    wrap_row(i, WRAP_INDEX_ROWS - 1);
+    rows = w->count;
+    if (!w->done) {
+      /* More rows than the index holds, count the rest */
+      const char *s = scroll_text(i);
+      int pos = w->row[w->count - 1], shown;
+      rows--;
+      do {
+        pos += wrap_next(s + pos, w->len - pos, &shown);
+        rows++;
+      } while (pos < w->len);
+    }
+    scrollback.rows[slot] = rows;
+  }
+  return scrollback.rows[slot];
+}
 
-  int start = scrollback.line_count - VISIBLE_LINES - scrollback.scroll_offset;
-  if (start < 0)
-    start = 0;
+/* Make row y of the screen show text, padded with spaces. Only the cells
+ * that differ from what screen[] says is there are drawn. */
+static void screen_row(int y, const char *text, int len) {
+  for (int x = 0; x < CONSOLE_COLS; x++) {
+    char c = x < len ? text[x] : ' ';
+    if (screen[y][x] != c) {
+      screen[y][x] = c;
+#ifdef FB_RENDER
+      fb_drawchar(c, x, y);
+#else
+      nio_csl_savechar(&csl, c, x, y);
+      nio_csl_drawchar(&csl, x, y);
+      nio_dirty = true;
+#endif
+    }
+  }
+}
 
-  for (int i = 0; i < VISIBLE_LINES && (start + i) < scrollback.line_count;
-       i++) {
-    nio_fputs(scrollback.lines[start + i], &csl);
-    nio_fputc('\n', &csl);
+/* Move the text rows on screen down n rows, or up if n is negative, as
+ * when the view goes n rows further back. With the framebuffer the pixels
+ * move too, so the next redraw only draws the rows that came into view.
+ * The console can't be shifted, so there screen[] is left alone and the
+ * redraw does it all. */
+static void screen_scroll(int n) {
+#ifdef FB_RENDER
+  int keep = VISIBLE_LINES - (n < 0 ? -n : n);
+  int from = n < 0 ? -n : 0, to = n < 0 ? 0 : n;
+
+  if (keep <= 0)
+    return;
+  memmove(screen[to], screen[from], keep * sizeof(screen[0]));
+  memmove(fb + to * GLYPH_H * FB_WIDTH, fb + from * GLYPH_H * FB_WIDTH,
+          keep * GLYPH_H * FB_WIDTH * sizeof(*fb));
+  fb_dirty = true;
+#else
+  (void)n;
+#endif
+}
+
+/* Bring the given DRAW_ parts of the screen up to date. Typing only needs
+ * DRAW_INPUT, which costs the same however much text is on screen. */
+static void paint(unsigned parts) {
+  if (parts & DRAW_TEXT) {
+    /* Walk back from the end to the message with the top row of the view.
+     * Only that one and those below it are wrapped. */
+    int want = scrollback.scroll_offset + VISIBLE_LINES;
+    int i = scrollback.count, below = 0;
+    while (i > 0 && below < want)
+      below += scroll_rows(--i);
+    int row = below - want;
+    scrollback.at_top = i == 0 && row <= 0;
+    if (row < 0) {
+      /* Scrolled back past the oldest row */
+      scrollback.scroll_offset =
+          below > VISIBLE_LINES ? below - VISIBLE_LINES : 0;
+      row = 0;
+    }
+
+    int n = 0;
+    for (; n < VISIBLE_LINES && i < scrollback.count; i++, row = 0) {
+      const char *s = scroll_text(i);
+      int len = scroll_len(i);
+      int pos = row ? wrap_row(i, row) : 0;
+      do {
+        int shown, next = pos + wrap_next(s + pos, len - pos, &shown);
+        screen_row(n++, s + pos, shown);
+        pos = next;
+      } while (n < VISIBLE_LINES && pos < len);
+    }
+    while (n < VISIBLE_LINES)
+      screen_row(n++, "", 0);
+  }
+
+  /* Prompt bar, with the connection state */
+  if (parts & DRAW_BAR) {
+    char bar[CONSOLE_COLS + 48];
+    if (conn_state == CONN_UP)
+      sprintf(bar, "-- Online, %u baud ", current_baud);
+    else
+      strcpy(bar, conn_state == CONN_FAILED ? "-- Offline " : "-- Connecting ");
+    if (queued_count > 0)
+      sprintf(bar + strlen(bar), "- %d queued ", queued_count);
+    for (int i = strlen(bar); i < CONSOLE_COLS; i++)
+      bar[i] = '-';
+    screen_row(VISIBLE_LINES, bar, CONSOLE_COLS);
   }
 
-  for (int i = 0; i < CONSOLE_COLS; i++)
-    nio_fputc('-', &csl);
-  nio_fputc('\n', &csl);
-  nio_fputs("> ", &csl);
-  nio_fputs(input_buffer, &csl);
+  /* The prompt, wrapped over the rows left below the bar */
+  if (parts & DRAW_INPUT) {
+    char line[MAX_INPUT_LEN + 2];
+    int len = sprintf(line, "> %s", input_buffer);
+    int pos = 0;
+    for (int y = VISIBLE_LINES + 1; y < CONSOLE_ROWS; y++) {
+      int n = len - pos < CONSOLE_COLS ? len - pos : CONSOLE_COLS;
+      screen_row(y, line + pos, n);
+      pos += n;
+    }
+  }
 
-  /* Flush to screen */
-  nio_drawing_enabled(&csl, true);
-  nio_fflush(&csl);
+  /* Cells only reach the LCD once flushed, like the framebuffer */
+#ifdef FB_RENDER
+  fb_flush();
+#else
+  if (nio_dirty) {
+    nio_fflush(&csl);
+    nio_dirty = false;
+  }
+#endif
+}
+
+/* Note parts of the screen as out of date. They are painted together by
+ * screen_flush() from the main loop, however many changes came first. */
+static void redraw_parts(unsigned parts) { draw_pending |= parts; }
+
+static void redraw(void) { redraw_parts(DRAW_ALL); }
+
+/* Paint what has changed straight away */
+static void redraw_now(void) {
+  unsigned parts = draw_pending;
+
+  draw_pending = 0;
+  paint_time = get_time_ms();
+  paint(parts);
+}
+
+#ifdef PAINT_BENCH
+/* Time full repaints, every cell drawn as after a clear, and log the
+ * average so the nspireio and FB_RENDER builds can be compared on the
+ * calculator. The screen looks the same afterwards, but the UI stalls while
+ * it runs, so it is only built in with PAINT_BENCH. */
+static void paint_benchmark(void) {
+#ifdef FB_RENDER
+  const char *renderer = "framebuffer";
+#else
+  const char *renderer = "nspireio";
+#endif
+  unsigned total = 0;
+
+  for (int i = 0; i < PAINT_BENCH_RUNS; i++) {
+    memset(screen, 0, sizeof(screen));
+    unsigned start = get_time_us();
+    paint(DRAW_ALL);
+    total += get_time_us() - start;
+  }
+  link_log("Paint: full screen in %u us with %s", total / PAINT_BENCH_RUNS,
+           renderer);
+}
+#endif
+
+/* Paint what has changed, at most once every FRAME_MS. Bytes waiting in
+ * rx_ring go first, but painting waits no longer than REDRAW_INTERVAL_MS
+ * for them. */
+static void screen_flush(void) {
+  unsigned now = get_time_ms();
+
+  if (!draw_pending || (now - paint_time) < FRAME_MS)
+    return;
+  if (uart_has_data() && (now - paint_time) < REDRAW_INTERVAL_MS)
+    return;
+  redraw_now();
+}
+
+/* A message whose text arrives in pieces, added with scroll_append() */
+static void scroll_stream_begin(const char *prefix) {
+  scroll_add_line(prefix);
+  stream_active = true;
+}
+
+static void scroll_stream_end(void) { stream_active = false; }
+
+/* Scroll so that message first, numbered as in scrollback.total, starts at
+ * the top of the screen, or as close as the scrollback allows */
+static void scroll_show_from(unsigned first) {
+  int i = (int)(first - (scrollback.total - scrollback.count));
+  int rows = 0;
+
+  for (int k = scrollback.count - 1; k >= i && k >= 0; k--)
+    rows += scroll_rows(k);
+  scrollback.scroll_offset = rows > VISIBLE_LINES ? rows - VISIBLE_LINES : 0;
+}
+
+/* Show a transient status line under the conversation, replacing the
+ * previous one */
+static void status_set(const char *text) {
+  if (stream_active)
+    return; /* The reply itself is being drawn there */
+  if (status_shown)
+    scroll_remove_line();
+  scroll_add_line(text);
+  status_shown = true;
+  redraw_parts(DRAW_TEXT);
+}
+
+static void status_clear(void) {
+  if (status_shown)
+    scroll_remove_line();
+  status_shown = false;
 }
 
 /* ============================================================================
@@ -297,33 +1379,124 @@ static void redraw(void) {
  * ============================================================================
  */
 
+/* Requests go out as F_REQ frames of [seq][bytes] followed by F_REQ_END with
+ * a new request ID. The bytes are the JSON itself, or its LZ compressed form
+ * when negotiated, encoded on the fly. */
+static LzEncoder upload_lz;
+static unsigned char upload_block[FRAME_MAX_PAYLOAD]; /* [seq][bytes] */
+static int upload_block_len;
+static unsigned upload_bytes; /* Sent this request, for link_log() */
+static unsigned char req_id;  /* Tags the reply to the latest upload */
+
+static void upload_flush_block(void) {
+  link_send(F_REQ, upload_block, upload_block_len);
+  upload_bytes += upload_block_len + FRAME_OVERHEAD;
+  upload_block[0]++;
+  upload_block_len = 1;
+}
+
+static void upload_emit(const unsigned char *data, int len) {
+  while (len > 0) {
+    int n = sizeof(upload_block) - upload_block_len;
+    if (n > len)
+      n = len;
+    memcpy(upload_block + upload_block_len, data, n);
+    upload_block_len += n;
+    data += n;
+    len -= n;
+    if (upload_block_len == (int)sizeof(upload_block))
+      upload_flush_block();
+  }
+}
+
+static void upload_write(const char *s, int len) {
+  if (!link_compressed_upload) {
+    upload_emit((const unsigned char *)s, len);
+    return;
+  }
+
+  unsigned char out[LZ_ENCODE_BOUND(16)];
+  while (len > 0) {
+    int n = len < 16 ? len : 16;
+    upload_emit(out,
+                lz_encode(&upload_lz, (const unsigned char *)s, n, out));
+    s += n;
+    len -= n;
+  }
+}
+
+static void upload_puts(const char *s) { upload_write(s, strlen(s)); }
+
+static void upload_begin(void) {
+  upload_block[0] = 0;
+  upload_block_len = 1;
+  upload_bytes = 0;
+  req_id++;
+  if (link_compressed_upload)
+    lz_encoder_init(&upload_lz);
+}
+
+static void upload_end(void) {
+  if (link_compressed_upload) {
+    unsigned char out[LZ_ENCODE_BOUND(0)];
+    upload_emit(out, lz_flush(&upload_lz, out));
+  }
+  if (upload_block_len > 1)
+    upload_flush_block();
+  link_send(F_REQ_END, &req_id, 1);
+}
+
+/* What json_escape_to_uart() does with each byte: 0 passes it through,
+ * JSON_DROP leaves it out and anything else is sent after a backslash */
+#define JSON_DROP 1
+static const unsigned char json_escape[256] = {
+    [0 ... 8] = JSON_DROP,    ['\t'] = 't',  ['\n'] = 'n',
+    [11 ... 12] = JSON_DROP,  ['\r'] = 'r',  [14 ... 31] = JSON_DROP,
+    ['"'] = '"',              ['\\'] = '\\', [127 ... 255] = JSON_DROP,
+};
+
+/* Safe characters go out in runs rather than one at a time. The NUL entry
+ * isn't 0, so it ends a run too. */
 static void json_escape_to_uart(const char *s) {
-  while (*s) {
-    switch (*s) {
-    case '"':
-      uart_write_str("\\\"");
-      break;
-    case '\\':
-      uart_write_str("\\\\");
-      break;
-    case '\n':
-      uart_write_str("\\n");
-      break;
-    case '\r':
-      uart_write_str("\\r");
-      break;
-    case '\t':
-      uart_write_str("\\t");
-      break;
-    default:
-      if (*s >= 32 && *s < 127)
-        uart_write_char(*s);
+  while (1) {
+    const char *run = s;
+    while (!json_escape[(unsigned char)*s])
+      s++;
+    if (s > run)
+      upload_write(run, s - run);
+    if (!*s)
       break;
+
+    unsigned char e = json_escape[(unsigned char)*s++];
+    if (e != JSON_DROP) {
+      char esc[2] = {'\\', e};
+      upload_write(esc, 2);
     }
-    s++;
   }
 }
 
+/* Escape s into out, or only measure it if out is NULL. Returns the escaped
+ * length. */
+static int json_escape_to_buf(char *out, const char *s) {
+  int len = 0;
+
+  for (; *s; s++) {
+    unsigned char e = json_escape[(unsigned char)*s];
+    if (!e) {
+      if (out)
+        out[len] = *s;
+      len++;
+    } else if (e != JSON_DROP) {
+      if (out) {
+        out[len] = '\\';
+        out[len + 1] = e;
+      }
+      len += 2;
+    }
+  }
+  return len;
+}
+
 /* Wake ESP32 from light-sleep before sending a request */
 static void wake_esp32(void) {
   /* Send wake bytes to trigger ESP32 wake from sleep */
@@ -333,29 +1506,46 @@ static void wake_esp32(void) {
   unsigned start = get_time_ms();
   while ((get_time_ms() - start) < 20) {
     /* Drain any garbage from wakeup */
-    if (uart_has_data())
+    while (uart_has_data())
       uart_read_char();
+    idle();
   }
 }
 
-static void send_request(const char *prompt) {
-  wake_esp32();
-
-  uart_write_str("{\"history\":[");
+/* The ESP32 keeps the conversation, so normally only the prompt goes out,
+ * along with how many turns we expect it to have. With full set, or when it
+ * has lost track, the whole history is sent for it to start over from. */
+static void send_request(const char *prompt, bool full) {
+  char head[48];
 
-  for (int i = 0; i < history.count; i++) {
-    if (i > 0)
-      uart_write_char(',');
-    uart_write_str("{\"role\":\"");
-    uart_write_str(history.turns[i].role);
-    uart_write_str("\",\"parts\":[{\"text\":\"");
-    json_escape_to_uart(history.turns[i].content);
-    uart_write_str("\"}]}");
+  wake_esp32();
+  request_start = get_time_ms();
+  upload_begin();
+
+  sprintf(head, "{\"session\":%u,", session_id);
+  upload_puts(head);
+  if (full) {
+    upload_puts("\"history\":[");
+    for (int i = 0; i < history.count; i++) {
+      if (i > 0)
+        upload_puts(",");
+      upload_write(history.turns[i].json, history.turns[i].json_len);
+    }
+    upload_puts("],");
+  } else {
+    sprintf(head, "\"turns\":%d,", history.count);
+    upload_puts(head);
   }
 
-  uart_write_str("],\"current_prompt\":\"");
+  upload_puts("\"current_prompt\":\"");
   json_escape_to_uart(prompt);
-  uart_write_str("\"}\n");
+  upload_puts("\"}");
+  upload_end();
+
+  /* Time to queue the request. Most of it is still going out of tx_ring
+   * while we wait for the reply. */
+  link_log("Request: %u bytes queued in %u ms", upload_bytes,
+           get_time_ms() - request_start);
 }
 
 /* ============================================================================
@@ -363,137 +1553,122 @@ static void send_request(const char *prompt) {
  * ============================================================================
  */
 
-static int wait_for_len_or_error(void) {
-  /* Wait for either LEN:xxxx or ERR:xxxx */
-  char buf[32];
-  int idx = 0;
-  unsigned start = get_time_ms();
+static void on_progress(const unsigned char *payload, int len) {
+  static const char *const stages[] = {
+      NULL, "[Connecting...]", "[Waiting for model...]", "[Generating...]"};
 
-  while ((get_time_ms() - start) < 60000) {
-    if (uart_has_data()) {
-      char c = uart_read_char();
-      if (c == '\n') {
-        buf[idx] = '\0';
-        if (strncmp(buf, "LEN:", 4) == 0) {
-          return atoi(buf + 4); /* Return length */
-        }
-        if (strncmp(buf, "ERR:", 4) == 0) {
-          scroll_add_text("[", buf);
-          scroll_add_line("]");
-          return -1; /* Error */
-        }
-        idx = 0; /* Reset for next line */
-      } else if (idx < 31) {
-        buf[idx++] = c;
-      }
-    }
-    if (isKeyPressed(KEY_NSPIRE_ESC)) {
-      scroll_add_line("[Cancelled]");
-      return -1;
-    }
-  }
-  scroll_add_line("[Timeout waiting for response]");
-  return -1;
+  if (req_state == REQ_WAIT && len >= 1 &&
+      payload[0] < sizeof(stages) / sizeof(stages[0]) && stages[payload[0]])
+    status_set(stages[payload[0]]);
 }
 
-static bool receive_response(char *response_buf, int max_len) {
-  /* Get length from header */
-  int expected_len = wait_for_len_or_error();
-  if (expected_len < 0) {
-    redraw();
-    return false;
-  }
-  if (expected_len == 0) {
-    response_buf[0] = '\0';
-    scroll_add_line("AI: (empty response)");
-    redraw();
-    return true;
-  }
-  if (expected_len >= max_len) {
-    expected_len = max_len - 1;
-  }
+/* A chunk outside a transfer is a resend from one we finished or gave up on.
+ * ACK it under its own request ID so the ESP32 can finish instead of
+ * retrying. */
+static void on_stray_chunk(const unsigned char *payload, int len) {
+  if (len >= 2)
+    link_send(F_ACK, payload, 2);
+}
 
-  /* Send ACK for LEN header */
-  uart_write_char('A');
+/* Frames that may turn up while we wait for something else */
+static const FrameHandler link_handlers[] = {
+    {F_PROGRESS, on_progress},
+    {F_CHUNK, on_stray_chunk},
+};
 
-  /* Receive data in chunks with ACK */
-  int received = 0;
-  unsigned start = get_time_ms();
-  const int CHUNK_SIZE = 64;
-
-  while (received < expected_len) {
-    int chunk_target = (expected_len - received > CHUNK_SIZE)
-                           ? CHUNK_SIZE
-                           : (expected_len - received);
-    int chunk_got = 0;
-
-    /* Read one chunk */
-    while (chunk_got < chunk_target && (get_time_ms() - start) < 120000) {
-      if (uart_has_data()) {
-        char c = uart_read_char();
-        if (c == EOT_CHAR) {
-          /* Use what we have if EOT comes early */
-          goto done;
-        }
-        response_buf[received + chunk_got] = c;
-        chunk_got++;
-        start = get_time_ms(); /* Reset timeout */
-      } else if (isKeyPressed(KEY_NSPIRE_ESC)) {
-        scroll_add_line("[Cancelled]");
-        response_buf[received] = '\0';
-        redraw();
-        return false;
-      }
-    }
+static void link_dispatch(void) {
+  frame_dispatch(link_handlers,
+                 sizeof(link_handlers) / sizeof(link_handlers[0]), &rx_frame);
+}
 
-    received += chunk_got;
+static void chunk_send_ctl(unsigned char type, unsigned char seq) {
+  unsigned char ctl[2] = {req_id, seq};
+  link_send(type, ctl, 2);
+}
 
-    /* Send ACK for this chunk */
-    uart_write_char('A');
-  }
+/* The reply is drawn as it arrives, as this scrollback message. Painting it
+ * is left to screen_flush(), which gives way to the transfer, and the UART
+ * interrupt keeps filling rx_ring while a paint is in progress. */
+static unsigned reply_msg; /* Numbered as in scrollback.total */
+static bool reply_follow; /* Cleared when the user scrolls during the reply */
+static unsigned reply_header_ms, reply_text_ms; /* Since request_start */
+
+static void reply_begin(void) {
+  status_clear();
+  reply_msg = scrollback.total;
+  reply_follow = true;
+  reply_header_ms = get_time_ms() - request_start;
+  reply_text_ms = 0;
+  scroll_stream_begin("AI: ");
+  redraw_parts(DRAW_TEXT);
+}
 
-done:
-  response_buf[received] = '\0';
+static void reply_show(const char *text, int len) {
+  int rows = scroll_rows(scrollback.count - 1);
 
-  /* Wait for EOT */
-  start = get_time_ms();
-  while ((get_time_ms() - start) < 2000) {
-    if (uart_has_data()) {
-      if (uart_read_char() == EOT_CHAR)
-        break;
-    }
-  }
+  if (!reply_text_ms && len > 0)
+    reply_text_ms = get_time_ms() - request_start;
+  scroll_append(text, len);
 
-  /* Display the response, scroll to show its beginning */
-  int line_before = scrollback.line_count;
+  /* Hold the view still while the user reads further up */
+  if (!reply_follow && scrollback.scroll_offset > 0)
+    scrollback.scroll_offset += scroll_rows(scrollback.count - 1) - rows;
 
-  scroll_add_text("AI: ", response_buf);
-  scroll_add_line("");
+  if (reply_follow)
+    scroll_show_from(reply_msg);
+  redraw_parts(DRAW_TEXT);
+}
 
-  /* Calculate scroll offset to show start of response at top.
-   * From redraw(): start = line_count - VISIBLE_LINES - scroll_offset
-   * We want: start = line_before (first line of response)
-   * So: scroll_offset = line_count - VISIBLE_LINES - line_before
-   *                          = response_lines - VISIBLE_LINES
-   * This seems to work
-   */
-  int response_lines = scrollback.line_count - line_before;
-  int target_offset = response_lines - VISIBLE_LINES;
-
-  /* Clamp to valid range */
-  int max_offset = scrollback.line_count - VISIBLE_LINES;
-  if (max_offset < 0)
-    max_offset = 0;
-  if (target_offset > max_offset)
-    target_offset = max_offset;
-  if (target_offset < 0)
-    target_offset = 0;
-
-  scrollback.scroll_offset = target_offset;
+/* Receiver state for the reply in flight, see chunk_receive() */
+static WindowReceiver chunk_rx;
+static LzDecoder chunk_lz;
+static char *reply_buf;
+static int reply_len, reply_shown;
+
+static void chunks_begin(char *buf) {
+  window_receiver_init(&chunk_rx);
+  lz_decoder_init(&chunk_lz);
+  reply_buf = buf;
+  reply_len = reply_shown = 0;
+}
 
-  redraw();
+/* Keep acknowledging past the end of the buffer so the ESP32 can finish
+ * cleanly, just drop what doesn't fit */
+static void chunk_deliver(const unsigned char *data, int len) {
+  if (link_compressed) {
+    reply_len += lz_decode(&chunk_lz, data, len,
+                           (unsigned char *)reply_buf + reply_len,
+                           MAX_RESPONSE_LEN - 1 - reply_len);
+  } else {
+    for (int i = 0; i < len; i++) {
+      if (reply_len < MAX_RESPONSE_LEN - 1)
+        reply_buf[reply_len++] = data[i];
+    }
+  }
+}
 
-  return true;
+/* Take the F_CHUNK frame in rx_frame, already checked for req_id, or a
+ * corrupted frame if intact is false, for a reply sent as described in
+ * protocol.h. Returns true once the last chunk is in. */
+static bool chunk_receive(bool intact) {
+  bool finished = false;
+
+  if (intact)
+    finished = window_receive(&chunk_rx, rx_frame.payload + 1,
+                              rx_frame.len - 1, chunk_send_ctl, chunk_deliver);
+  else
+    window_receive_bad(&chunk_rx, chunk_send_ctl);
+
+  /* Recovering is cheap, but if it keeps happening the baud rate is too
+   * much for this link */
+  if (chunk_rx.corrupted > LINK_WINDOW)
+    link_error = true;
+
+  if (reply_len != reply_shown) {
+    reply_show(reply_buf + reply_shown, reply_len - reply_shown);
+    reply_shown = reply_len;
+  }
+  return finished;
 }
 
 /* ============================================================================
@@ -502,25 +1677,60 @@ done:
  */
 
 static void history_add(const char *role, const char *content) {
+  static const char head[] = "{\"role\":\"%s\",\"parts\":[{\"text\":\"";
+  static const char suffix[] = "\"}]}";
+  int prefix = snprintf(NULL, 0, head, role);
+  int len = prefix + json_escape_to_buf(NULL, content) + sizeof(suffix) - 1;
+
+  char *json = malloc(len + 1);
+  if (!json)
+    return;
+  sprintf(json, head, role);
+  strcpy(json + prefix + json_escape_to_buf(json + prefix, content), suffix);
+
   if (history.count >= MAX_HISTORY_TURNS) {
-    free(history.turns[0].content);
+    free(history.turns[0].json);
     memmove(&history.turns[0], &history.turns[1],
             (MAX_HISTORY_TURNS - 1) * sizeof(ChatTurn));
     history.count--;
   }
 
-  strcpy(history.turns[history.count].role, role);
-  history.turns[history.count].content = strdup(content);
+  history.turns[history.count].json = json;
+  history.turns[history.count].json_len = len;
   history.count++;
 }
 
-static void history_free(void) {
-  for (int i = 0; i < history.count; i++) {
-    free(history.turns[i].content);
-  }
-  history.count = 0;
+/* Forget all but the newest keep turns */
+static void history_trim(int keep) {
+  int drop = history.count - keep;
+
+  if (drop <= 0)
+    return;
+  for (int i = 0; i < drop; i++)
+    free(history.turns[i].json);
+  memmove(&history.turns[0], &history.turns[drop], keep * sizeof(ChatTurn));
+  history.count = keep;
+}
+
+/* Forget the oldest turns until a full send_request() of prompt fits the
+ * ESP32's request buffer. It keeps what it is sent, so the turn counts
+ * still agree afterwards. */
+static void history_fit(const char *prompt) {
+  static const char frame[] =
+      "{\"session\":4294967295,\"history\":[],\"current_prompt\":\"\"}";
+  int room = MAX_REQUEST_SIZE - 1 - (int)(sizeof(frame) - 1) -
+             json_escape_to_buf(NULL, prompt);
+  int keep = 0;
+
+  /* Each turn after the first costs a comma too */
+  while (keep < history.count &&
+         (room -= history.turns[history.count - 1 - keep].json_len + 1) >= 0)
+    keep++;
+  history_trim(keep);
 }
 
+static void history_free(void) { history_trim(0); }
+
 /* ============================================================================
  * Keyboard
  * ============================================================================
@@ -561,22 +1771,375 @@ static const KeyMap key_map[] = {
 
 #define KEY_MAP_SIZE (sizeof(key_map) / sizeof(key_map[0]))
 static bool key_was_pressed[KEY_MAP_SIZE];
+static unsigned short key_matrix[KEYPAD_ROWS];
+
+/* Compare the key matrix with the last look at it. Returns true if any key
+ * went up or down since. */
+static bool keypad_changed(void) {
+  bool changed = false;
+
+  for (int i = 0; i < KEYPAD_ROWS; i++) {
+    unsigned short row = KEYPAD_DATA[i];
+    if (row != key_matrix[i]) {
+      key_matrix[i] = row;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/* ============================================================================
+ * Event Loop
+ * ============================================================================
+ */
+
+enum {
+  EV_UART = 0x01, /* Bytes waiting in rx_ring */
+  EV_KEYS = 0x02, /* A key went up or down */
+  EV_TICK = 0x04, /* EVENT_TICK_MS passed */
+  EV_DRAW = 0x08, /* A paint is pending and FRAME_MS has passed */
+};
+
+/* Sleep until there is something to do. The UART, keypad and OS timer
+ * interrupts all wake idle(), and the checks after each are cheap, so the
+ * CPU is halted for nearly all of a wait. Returns the EV_ bits that are
+ * pending. */
+static unsigned event_wait(void) {
+  static unsigned last_tick;
+
+  while (1) {
+    unsigned events = 0;
+    if (uart_has_data())
+      events |= EV_UART;
+    if (keypad_changed())
+      events |= EV_KEYS;
+    /* Kept even while a busy link returns EV_UART every pass */
+    if ((get_time_ms() - last_tick) >= EVENT_TICK_MS) {
+      last_tick = get_time_ms();
+      events |= EV_TICK;
+    }
+    if (draw_pending && (get_time_ms() - paint_time) >= FRAME_MS)
+      events |= EV_DRAW;
+    if (events)
+      return events;
+    idle();
+  }
+}
 
 /* ============================================================================
  * Main
  * ============================================================================
  */
 
+/* The request is done with, successfully or not */
+static void req_finish(bool ok) {
+  /* Keep the turn counts in step with the ESP32's session. If they still
+   * drift apart, the next request is answered with ERR:SESSION and the
+   * history is sent again. */
+  if (req_counted)
+    history_add("user", req_prompt);
+  if (ok && req_response[0])
+    history_add("model", req_response);
+  free(req_prompt);
+  free(req_response);
+  req_prompt = req_response = NULL;
+  req_state = REQ_IDLE;
+
+  /* A corrupted transfer at a negotiated rate means the wiring can't take
+   * it, so fall back */
+  if (link_error && current_baud != BAUD_RATE)
+    uart_negotiate_baud(BAUD_RATE);
+  link_error = false;
+  redraw();
+}
+
+/* Send a prompt, taking ownership of it. req_pump() does the rest. */
+static void req_start(char *prompt) {
+  scroll_add_text("You: ", prompt);
+  scroll_add_line("");
+
+  req_response = malloc(MAX_RESPONSE_LEN);
+  if (!req_response) {
+    free(prompt);
+    scroll_add_line("[Out of memory]");
+    redraw_parts(DRAW_TEXT);
+    return;
+  }
+  req_prompt = prompt;
+  req_full = req_counted = false;
+  req_dropped = rx_dropped;
+  status_set("[Thinking...]");
+  redraw_now(); /* Sending a long history can hold up the main loop */
+
+  send_request(prompt, false);
+  req_state = REQ_WAIT;
+  req_since = get_time_ms();
+}
+
+/* Give up on the request in flight, leaving the link ready for the next */
+static void req_cancel(const char *why) {
+  scroll_stream_end();
+  status_clear();
+  link_cancel();
+  scroll_add_line(why);
+  req_finish(false);
+
+  /* Don't let the same ESC press exit the app */
+  while (isKeyPressed(KEY_NSPIRE_ESC))
+    idle();
+}
+
+static void req_error(void) {
+  char buf[32];
+  int len = rx_frame.len < 27 ? rx_frame.len : 27;
+
+  /* The ESP32 lost the conversation. Not for the user, we resend it all. */
+  if (!req_full && rx_frame.len == 7 &&
+      memcmp(rx_frame.payload, "SESSION", 7) == 0) {
+    req_full = true;
+    history_fit(req_prompt);
+    send_request(req_prompt, true);
+    req_since = get_time_ms();
+    return;
+  }
+
+  memcpy(buf, "ERR:", 4);
+  memcpy(buf + 4, rx_frame.payload, len);
+  buf[4 + len] = '\0';
+  /* The ESP32 sends these before it adds the prompt to its session, the
+   * rest after */
+  req_counted = strcmp(buf, "ERR:API") != 0 && strcmp(buf, "ERR:LINK") != 0 &&
+                strcmp(buf, "ERR:SESSION") != 0;
+  status_clear();
+  scroll_add_text("[", buf);
+  scroll_add_line("]");
+  req_finish(false);
+}
+
+static void req_complete(void) {
+  if (reply_len == 0)
+    scroll_append("(empty response)", 16);
+  scroll_stream_end();
+  req_response[reply_len] = '\0';
+
+  link_log("Reply: %d bytes, header %u ms, first text %u ms, done %u ms",
+           reply_len, reply_header_ms, reply_text_ms,
+           get_time_ms() - request_start);
+  if (rx_dropped != req_dropped) {
+    scroll_add_line("[Receive buffer overrun, reply may be incomplete]");
+    link_error = true;
+  }
+  scroll_add_line("");
+
+  /* Leave the start of the response at the top of the screen */
+  if (reply_follow)
+    scroll_show_from(reply_msg);
+  req_finish(true);
+}
+
+/* Advance the request with whatever has arrived. While waiting for F_RESP
+ * the ESP32 sends progress frames, each of which restarts the timeout. */
+static void req_pump(void) {
+  int r;
+
+  switch (req_state) {
+  case REQ_WAIT:
+    while (req_state == REQ_WAIT && (r = link_poll()) != FRAME_NONE) {
+      if (r != FRAME_OK)
+        continue;
+      if ((rx_frame.type == F_RESP && rx_frame.len >= 5 &&
+           rx_frame.payload[4] == req_id) ||
+          (rx_frame.type == F_CHUNK && rx_frame.len >= 2 &&
+           rx_frame.payload[0] == req_id)) {
+        /* F_RESP is never resent, so if it was corrupted the first chunk of
+         * this reply to arrive starts it instead. Anything tagged for an
+         * earlier request is a leftover. */
+        reply_begin();
+        chunks_begin(req_response);
+        req_state = REQ_RECEIVE;
+        req_since = get_time_ms();
+        req_counted = true;
+        if (rx_frame.type == F_CHUNK && chunk_receive(true))
+          req_complete();
+      } else if (rx_frame.type == F_ERR) {
+        req_error();
+      } else {
+        /* Only sent once the prompt is in the ESP32's session */
+        if (rx_frame.type == F_PROGRESS) {
+          req_since = get_time_ms();
+          req_counted = true;
+        }
+        link_dispatch();
+      }
+    }
+    if (req_state == REQ_WAIT && (get_time_ms() - req_since) >= 60000)
+      req_cancel("[Timeout waiting for response]");
+    break;
+
+  case REQ_RECEIVE:
+    while (req_state == REQ_RECEIVE && (r = link_poll()) != FRAME_NONE) {
+      if (r == FRAME_OK &&
+          (rx_frame.type != F_CHUNK || rx_frame.len < 1 ||
+           rx_frame.payload[0] != req_id)) {
+        link_dispatch();
+        continue;
+      }
+      req_since = get_time_ms();
+      if (chunk_receive(r == FRAME_OK))
+        req_complete();
+    }
+    if (req_state == REQ_RECEIVE && (get_time_ms() - req_since) >= 120000)
+      req_cancel("[Timeout waiting for response]");
+    break;
+
+  default:
+    /* Nothing is expected, but whatever turns up still has to be read, or
+     * rx_ring never empties and event_wait() never sleeps. conn_pump()
+     * reads it while connecting. */
+    if (conn_state == CONN_UP || conn_state == CONN_FAILED) {
+      while ((r = link_poll()) != FRAME_NONE) {
+        if (r == FRAME_OK)
+          link_dispatch();
+      }
+    }
+    break;
+  }
+}
+
+/* The background connection came up or gave up. Report it, and drop
+ * anything typed in the meantime if it can't be sent. */
+static void conn_settled(void) {
+  char line[64];
+
+  if (conn_state == CONN_UP)
+    sprintf(line, "[%s at %u baud%s]", conn_resumed ? "Resumed" : "Connected",
+            current_baud, link_compressed ? ", compressed" : "");
+  else
+    strcpy(line, "[Connection failed, offline]");
+  scroll_add_line(line);
+#ifdef PAINT_BENCH
+  if (conn_state == CONN_UP)
+    paint_benchmark();
+#endif
+
+  if (queued_count > 0 && conn_state != CONN_UP) {
+    for (int i = 0; i < queued_count; i++)
+      free(queued_prompts[i]);
+    queued_count = 0;
+    scroll_add_line("[Queued prompts not sent]");
+  }
+  redraw();
+}
+
+/* Move the view rows further back, or towards the end if negative. The
+ * rows still in view are shifted rather than drawn again. */
+static void scroll_view(int rows) {
+  if (rows > 0 && scrollback.at_top)
+    return;
+  if (rows < -scrollback.scroll_offset)
+    rows = -scrollback.scroll_offset;
+  if (!rows)
+    return;
+
+  scrollback.scroll_offset += rows;
+  reply_follow = false;
+  screen_scroll(rows);
+  redraw_parts(DRAW_TEXT);
+}
+
+/* Act on the keypad. Returns false when it is time to exit. */
+static bool handle_keys(void) {
+  static bool enter_was, del_was;
+  static int scroll_dir;        /* 1 while Up is held, -1 for Down */
+  static unsigned scroll_next;  /* get_time_ms() of the next repeat */
+
+  /* ESC cancels the request in flight, otherwise exits */
+  if (isKeyPressed(KEY_NSPIRE_ESC)) {
+    if (req_state == REQ_IDLE)
+      return false;
+    req_cancel("[Cancelled]");
+  }
+
+  bool shift = isKeyPressed(KEY_NSPIRE_SHIFT);
+
+  /* Scroll up/down a row, or a page with CTRL, repeating while held */
+  int dir = isKeyPressed(KEY_NSPIRE_UP)     ? 1
+            : isKeyPressed(KEY_NSPIRE_DOWN) ? -1
+                                            : 0;
+  int step = isKeyPressed(KEY_NSPIRE_CTRL) ? VISIBLE_LINES - 1 : 1;
+  unsigned now = get_time_ms();
+  if (dir != scroll_dir) {
+    scroll_dir = dir;
+    scroll_next = now + KEY_REPEAT_DELAY_MS;
+    if (dir)
+      scroll_view(dir * step);
+  } else if (dir && (int)(now - scroll_next) >= 0) {
+    scroll_next = now + KEY_REPEAT_MS;
+    scroll_view(dir * step);
+  }
+
+  /* Send message */
+  bool enter = isKeyPressed(KEY_NSPIRE_ENTER) || isKeyPressed(KEY_NSPIRE_RET);
+  if (enter && !enter_was && input_len > 0) {
+    if (conn_state == CONN_FAILED) {
+      scroll_add_text("You: ", input_buffer);
+      scroll_add_line("");
+      scroll_add_line("[Not connected]");
+      input_buffer[0] = '\0';
+      input_len = 0;
+    } else if (queued_count < MAX_QUEUED_PROMPTS &&
+               (queued_prompts[queued_count] = strdup(input_buffer))) {
+      /* Sent from the main loop when the link is free. Until then it is
+       * only counted in the prompt bar, as a reply may be streaming into
+       * the end of the scrollback. */
+      queued_count++;
+      input_buffer[0] = '\0';
+      input_len = 0;
+    }
+    /* Otherwise the queue is full and the prompt stays where it is */
+    redraw();
+  }
+  enter_was = enter;
+
+  /* Backspace */
+  bool del = isKeyPressed(KEY_NSPIRE_DEL);
+  if (del && !del_was && input_len > 0) {
+    input_buffer[--input_len] = '\0';
+    redraw_parts(DRAW_INPUT);
+  }
+  del_was = del;
+
+  /* Regular keys */
+  for (unsigned i = 0; i < KEY_MAP_SIZE; i++) {
+    bool pressed = isKeyPressed(*key_map[i].key);
+    if (pressed && !key_was_pressed[i] && input_len < MAX_INPUT_LEN - 1) {
+      input_buffer[input_len++] =
+          shift ? key_map[i].shifted : key_map[i].normal;
+      input_buffer[input_len] = '\0';
+      redraw_parts(DRAW_INPUT);
+    }
+    key_was_pressed[i] = pressed;
+  }
+  return true;
+}
+
 int main(void) {
   if (!nio_init(&csl, CONSOLE_COLS, CONSOLE_ROWS, 0, 0, NIO_COLOR_BLACK,
                 NIO_COLOR_WHITE, true)) {
     return 1;
   }
   nio_set_default(&csl);
+#ifdef FB_RENDER
+  if (!fb_init()) {
+    nio_free(&csl);
+    return 1;
+  }
+#endif
 
   memset(&history, 0, sizeof(history));
   memset(&scrollback, 0, sizeof(scrollback));
   memset(key_was_pressed, 0, sizeof(key_was_pressed));
+  memset(screen, ' ', sizeof(screen)); /* nio_init() left it blank */
   input_buffer[0] = '\0';
 
   /* Save original UART config */
@@ -585,113 +2148,67 @@ int main(void) {
   os_lcr = UART_LCR_H;
   os_cr = UART_CR;
 
-  nio_printf("=== Renspired ===\n");
+  timer_init();
   uart_init();
-
-  bool connected = uart_handshake();
-  if (!connected) {
-    nio_printf("Press any key to continue offline...\n");
-    wait_key_pressed();
-  }
+  uart_irq_install();
+  conn_start();
 
   scroll_add_line("=== Renspired ===");
   scroll_add_line("Type and press Enter. ESC to exit.");
   scroll_add_line("");
   redraw();
 
-  bool up_was = false, down_was = false, enter_was = false, del_was = false;
-
   while (1) {
-    if (isKeyPressed(KEY_NSPIRE_ESC))
-      break;
-
-    bool shift = isKeyPressed(KEY_NSPIRE_SHIFT);
+    unsigned events = event_wait();
 
-    /* Scroll up/down */
-    bool up = isKeyPressed(KEY_NSPIRE_UP);
-    if (up && !up_was &&
-        scrollback.scroll_offset < scrollback.line_count - VISIBLE_LINES) {
-      scrollback.scroll_offset++;
-      redraw();
+    /* The tick drives the timeouts */
+    if (events & (EV_UART | EV_TICK)) {
+      if (conn_pump())
+        conn_settled();
+      req_pump();
     }
-    up_was = up;
-
-    bool down = isKeyPressed(KEY_NSPIRE_DOWN);
-    if (down && !down_was && scrollback.scroll_offset > 0) {
-      scrollback.scroll_offset--;
-      redraw();
-    }
-    down_was = down;
-
-    /* Send message */
-    bool enter = isKeyPressed(KEY_NSPIRE_ENTER) || isKeyPressed(KEY_NSPIRE_RET);
-    if (enter && !enter_was && input_len > 0) {
-      scroll_add_text("You: ", input_buffer);
-      scroll_add_line("");
-
-      if (connected) {
-        history_add("user", input_buffer);
-        scroll_add_line("[Thinking...]");
-        redraw();
 
-        send_request(input_buffer);
-
-        /* Remove thinking indicator */
-        if (scrollback.line_count > 0)
-          scrollback.line_count--;
-
-        char *response = malloc(MAX_RESPONSE_LEN);
-        if (response) {
-          if (receive_response(response, MAX_RESPONSE_LEN) && response[0]) {
-            history_add("model", response);
-          }
-          free(response);
-        }
-      } else {
-        scroll_add_line("[Not connected]");
-      }
+    /* Touchpad arrows aren't in the key matrix, so they are polled on the
+     * tick */
+    if ((events & (EV_KEYS | EV_TICK)) && !handle_keys())
+      break;
 
-      input_buffer[0] = '\0';
-      input_len = 0;
-      redraw();
-    }
-    enter_was = enter;
-
-    /* Backspace */
-    bool del = isKeyPressed(KEY_NSPIRE_DEL);
-    if (del && !del_was && input_len > 0) {
-      input_buffer[--input_len] = '\0';
-      redraw();
-    }
-    del_was = del;
-
-    /* Regular keys */
-    for (unsigned i = 0; i < KEY_MAP_SIZE; i++) {
-      bool pressed = isKeyPressed(*key_map[i].key);
-      if (pressed && !key_was_pressed[i] && input_len < MAX_INPUT_LEN - 1) {
-        input_buffer[input_len++] =
-            shift ? key_map[i].shifted : key_map[i].normal;
-        input_buffer[input_len] = '\0';
-        redraw();
-      }
-      key_was_pressed[i] = pressed;
+    /* Send the next prompt once the link is free */
+    if (conn_state == CONN_UP && req_state == REQ_IDLE && queued_count > 0) {
+      char *prompt = queued_prompts[0];
+      memmove(queued_prompts, queued_prompts + 1,
+              --queued_count * sizeof(queued_prompts[0]));
+      req_start(prompt);
+      redraw_parts(DRAW_BAR);
     }
 
-    idle();
+    /* Once per pass, for everything above */
+    screen_flush();
   }
 
   history_free();
-  nio_printf("\nExiting...\n");
-  msleep(300);
+  for (int i = 0; i < queued_count; i++)
+    free(queued_prompts[i]);
+#ifdef FB_RENDER
+  fb_free();
+#endif
+  nio_clear(&csl);
+  nio_printf("Exiting...\n");
+  /* Not msleep(), which would use the timer we still have */
+  uart_drain(300);
+
+  /* Leave the ESP32 at the default rate for the next launch */
+  if (conn_state == CONN_UP && current_baud != BAUD_RATE)
+    uart_negotiate_baud(BAUD_RATE);
 
   /* Restore UART */
-  while (uart_has_data())
-    uart_read_char();
+  uart_irq_remove();
   UART_CR = 0;
   UART_IBRD = os_ibrd;
   UART_FBRD = os_fbrd;
   UART_LCR_H = os_lcr;
   UART_CR = os_cr;
+  timer_restore();
 
   nio_free(&csl);
   return 0;
@@ -0,0 +1,269 @@
+/**
+ * Simulated UART link for the host tests
+ *
+ * Runs one reply through the chunk window in protocol.h, the ESP32 sending
+ * and the Nspire receiving, over a serial line that can flip bits, drop
+ * bytes and lose whole frames. Each side's half is driven the way its
+ * firmware drives it, but with a simulated clock, so a run takes
+ * milliseconds whatever the baud rate.
+ */
+
+#ifndef RENSPIRED_TESTS_LINK_H
+#define RENSPIRED_TESTS_LINK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../esp32/renspired/protocol.h"
+
+#define LINE_QUEUE 65536 /* Bytes on the wire at once, a power of two */
+#define SIM_STEP_US 50
+#define SIM_LIMIT_US (600ull * 1000000) /* A transfer that takes longer fails */
+
+typedef struct {
+  unsigned baud;
+  unsigned turnaround_us; /* From a chunk arriving to the Nspire's answer */
+  double flip;            /* Chance a byte has a bit flipped */
+  double drop;            /* Chance a byte never arrives */
+  double lose;            /* Chance a whole frame never arrives */
+} LinkConfig;
+
+typedef struct {
+  bool ok;           /* Delivered intact */
+  uint64_t us;       /* From the first chunk to the last ACK */
+  int chunks;        /* Chunk frames sent, resends included */
+  int resent;        /* Resends, by NAK or timeout */
+  int corrupted;     /* Bad frames the receiver saw */
+} LinkResult;
+
+/* One direction of the line. Bytes go out back to back at the baud rate. */
+typedef struct {
+  uint8_t bytes[LINE_QUEUE];
+  uint64_t at[LINE_QUEUE]; /* When each byte has fully arrived */
+  unsigned head, tail;
+  uint64_t free_at; /* When the transmitter is idle again */
+} Line;
+
+static uint64_t sim_now;
+static uint32_t sim_rng;
+static const LinkConfig *sim_cfg;
+static Line to_nspire, to_esp32;
+
+/* xorshift32, so runs repeat exactly for a seed */
+static uint32_t sim_rand(void) {
+  sim_rng ^= sim_rng << 13;
+  sim_rng ^= sim_rng >> 17;
+  sim_rng ^= sim_rng << 5;
+  return sim_rng;
+}
+
+static bool sim_chance(double p) {
+  return p > 0 && sim_rand() < p * 4294967296.0;
+}
+
+static uint32_t sim_ms(void) { return (uint32_t)(sim_now / 1000); }
+
+/* Put a frame on the line, ready to go out after delay_us */
+static void line_send(Line *l, uint8_t type, const void *payload, int len,
+                      unsigned delay_us) {
+  uint8_t frame[FRAME_MAX_PAYLOAD + FRAME_OVERHEAD];
+  int n = frame_encode(frame, type, payload, len);
+  uint64_t byte_us = (10 * 1000000ull + sim_cfg->baud / 2) / sim_cfg->baud;
+  uint64_t t = sim_now + delay_us > l->free_at ? sim_now + delay_us
+                                               : l->free_at;
+  bool lost = sim_chance(sim_cfg->lose);
+
+  for (int i = 0; i < n; i++) {
+    t += byte_us;
+    if (lost || sim_chance(sim_cfg->drop))
+      continue;
+    if (sim_chance(sim_cfg->flip))
+      frame[i] ^= 1 << (sim_rand() & 7);
+    if (l->tail - l->head == LINE_QUEUE) {
+      fprintf(stderr, "line queue overflow\n");
+      exit(2);
+    }
+    l->bytes[l->tail & (LINE_QUEUE - 1)] = frame[i];
+    l->at[l->tail & (LINE_QUEUE - 1)] = t;
+    l->tail++;
+  }
+  l->free_at = t;
+}
+
+/* Next byte that has arrived by now, or -1 */
+static int line_read(Line *l) {
+  if (l->head == l->tail || l->at[l->head & (LINE_QUEUE - 1)] > sim_now)
+    return -1;
+  return l->bytes[l->head++ & (LINE_QUEUE - 1)];
+}
+
+/* ============================================================================
+ * ESP32 end, as pumpChunks() in the sketch
+ * ============================================================================
+ */
+
+static WindowSender esp_window;
+static FrameParser esp_rx;
+static uint64_t esp_rx_last; /* When the last byte was read */
+static const uint8_t *esp_reply;
+static LinkResult *sim_result;
+
+#define SIM_REQ_ID 0x5A /* As sent with F_REQ_END */
+
+static void esp_send_chunk(uint8_t seq) {
+  uint8_t payload[2 + LINK_CHUNK_SIZE];
+  int slot = WINDOW_SLOT(seq);
+
+  payload[0] = SIM_REQ_ID;
+  payload[1] = seq;
+  memcpy(payload + 2, esp_reply + esp_window.off[slot], esp_window.len[slot]);
+  line_send(&to_nspire, F_CHUNK, payload, 2 + esp_window.len[slot], 0);
+  sim_result->chunks++;
+}
+
+static void esp_poll(void) {
+  while (true) {
+    int r = frame_parse_pending(&esp_rx), b;
+    if (r == FRAME_NONE) {
+      if ((b = line_read(&to_esp32)) >= 0) {
+        esp_rx_last = sim_now;
+        r = frame_parse(&esp_rx, b);
+      } else if (sim_now - esp_rx_last < FRAME_IDLE_MS * 1000ull ||
+                 frame_parse_idle(&esp_rx) == FRAME_NONE) {
+        break;
+      }
+    }
+    if (r != FRAME_OK || esp_rx.len < 2 || esp_rx.payload[0] != SIM_REQ_ID)
+      continue;
+    if (esp_rx.type == F_ACK) {
+      window_sender_ack(&esp_window, esp_rx.payload[1], sim_ms());
+    } else if (esp_rx.type == F_NAK &&
+               window_sender_nak(&esp_window, esp_rx.payload[1])) {
+      esp_send_chunk(esp_rx.payload[1]);
+      sim_result->resent++;
+    }
+  }
+}
+
+/* ============================================================================
+ * Nspire end, as req_pump() and chunk_receive() in main.c
+ * ============================================================================
+ */
+
+static WindowReceiver nspire_window;
+static FrameParser nspire_rx;
+static uint64_t nspire_rx_last;
+static uint8_t *nspire_reply;
+static int nspire_len, nspire_max;
+static bool nspire_finished;
+
+static void nspire_send_ctl(uint8_t type, uint8_t seq) {
+  uint8_t ctl[2] = {SIM_REQ_ID, seq};
+  line_send(&to_esp32, type, ctl, 2, sim_cfg->turnaround_us);
+}
+
+static void nspire_deliver(const uint8_t *data, int len) {
+  for (int i = 0; i < len; i++) {
+    if (nspire_len < nspire_max)
+      nspire_reply[nspire_len++] = data[i];
+  }
+}
+
+static void nspire_poll(void) {
+  while (true) {
+    int r = frame_parse_pending(&nspire_rx), b;
+    if (r == FRAME_NONE) {
+      if ((b = line_read(&to_nspire)) >= 0) {
+        nspire_rx_last = sim_now;
+        r = frame_parse(&nspire_rx, b);
+      } else if (sim_now - nspire_rx_last < FRAME_IDLE_MS * 1000ull ||
+                 (r = frame_parse_idle(&nspire_rx)) == FRAME_NONE) {
+        break;
+      }
+      if (r == FRAME_NONE)
+        continue;
+    }
+
+    if (nspire_finished) {
+      /* A resend after the end, from a lost ACK. on_stray_chunk() */
+      if (r == FRAME_OK && nspire_rx.type == F_CHUNK && nspire_rx.len >= 2)
+        nspire_send_ctl(F_ACK, nspire_rx.payload[1]);
+    } else if (r == FRAME_BAD) {
+      window_receive_bad(&nspire_window, nspire_send_ctl);
+    } else if (nspire_rx.type == F_CHUNK && nspire_rx.len >= 1 &&
+               nspire_rx.payload[0] == SIM_REQ_ID) {
+      nspire_finished = window_receive(&nspire_window, nspire_rx.payload + 1,
+                                       nspire_rx.len - 1, nspire_send_ctl,
+                                       nspire_deliver);
+    }
+  }
+}
+
+/* ============================================================================
+ * Transfer
+ * ============================================================================
+ */
+
+/* Send len bytes of reply across a link set up as cfg, with seed picking the
+ * noise */
+static LinkResult link_transfer(const LinkConfig *cfg, uint32_t seed,
+                                const uint8_t *reply, int len) {
+  LinkResult result = {0};
+  static uint8_t received[1 << 20];
+  int sent = 0;
+  bool terminated = false;
+
+  sim_cfg = cfg;
+  sim_rng = seed ? seed : 1;
+  sim_now = 0;
+  sim_result = &result;
+  memset(&to_nspire, 0, sizeof(to_nspire));
+  memset(&to_esp32, 0, sizeof(to_esp32));
+
+  window_sender_init(&esp_window);
+  frame_parser_init(&esp_rx);
+  esp_rx_last = 0;
+  esp_reply = reply;
+  window_receiver_init(&nspire_window);
+  frame_parser_init(&nspire_rx);
+  nspire_rx_last = 0;
+  nspire_reply = received;
+  nspire_len = 0;
+  nspire_max = sizeof(received);
+  nspire_finished = false;
+
+  while (sim_now < SIM_LIMIT_US) {
+    esp_poll();
+
+    /* Fill the window, then the empty chunk that ends the transfer */
+    while (!window_sender_full(&esp_window) && !terminated) {
+      int n = len - sent < LINK_CHUNK_SIZE ? len - sent : LINK_CHUNK_SIZE;
+      esp_send_chunk(window_sender_add(&esp_window, sent, n, sim_ms()));
+      sent += n;
+      terminated = n == 0;
+    }
+
+    int resend = window_sender_poll(&esp_window, sim_ms());
+    if (resend == WINDOW_GIVE_UP)
+      break;
+    if (resend >= 0) {
+      esp_send_chunk(resend);
+      result.resent++;
+    }
+
+    if (terminated && esp_window.in_flight == 0)
+      break;
+
+    nspire_poll();
+    sim_now += SIM_STEP_US;
+  }
+
+  result.us = sim_now;
+  result.corrupted = nspire_window.corrupted;
+  result.ok = terminated && esp_window.in_flight == 0 && nspire_finished &&
+              nspire_len == len && memcmp(received, reply, len) == 0;
+  return result;
+}
+
+#endif
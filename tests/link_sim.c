@@ -0,0 +1,79 @@
+/**
+ * Chunk window over a noisy link
+ *
+ * Sends a 16 KB reply through the window in protocol.h at increasing levels
+ * of damage: flipped bits, dropped bytes and lost frames. Every transfer
+ * has to arrive intact, however long the resends take, and one over a dead
+ * line has to give up rather than hang. Exits non-zero if one doesn't.
+ */
+
+#include "link.h"
+
+#define REPLY_LEN 16384
+#define RUNS 200
+
+static const struct {
+  const char *name;
+  double flip, drop, lose;
+} levels[] = {
+    {"clean", 0, 0, 0},
+    {"flip 1e-4", 1e-4, 0, 0},
+    {"flip 1e-3", 1e-3, 0, 0},
+    {"flip 3e-3", 3e-3, 0, 0},
+    {"drop 1e-3", 0, 1e-3, 0},
+    {"lose 5%", 0, 0, 0.05},
+    {"lose 20%", 0, 0, 0.20},
+    {"all 1e-3, 5%", 1e-3, 1e-3, 0.05},
+};
+
+int main(void) {
+  static uint8_t reply[REPLY_LEN];
+  int failed = 0;
+
+  /* Text-like bytes, and the odd SOF so the parser has to cope with it in a
+   * payload */
+  for (int i = 0; i < REPLY_LEN; i++)
+    reply[i] = i % 97 == 0 ? FRAME_SOF : ' ' + (i * 7 + i / 13) % 95;
+
+  printf("%-14s %5s %9s %9s %9s %9s\n", "link", "fail", "ms", "resent",
+         "corrupt", "bytes/s");
+  for (unsigned l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+    LinkConfig cfg = {115200, 2000, levels[l].flip, levels[l].drop,
+                      levels[l].lose};
+    uint64_t us = 0;
+    long resent = 0, corrupted = 0;
+    int fails = 0;
+
+    for (int run = 0; run < RUNS; run++) {
+      LinkResult r = link_transfer(&cfg, 0x9E3779B9u * (run + 1), reply,
+                                   REPLY_LEN);
+      if (!r.ok) {
+        fprintf(stderr, "%s: run %d failed after %llu ms\n", levels[l].name,
+                run, (unsigned long long)(r.us / 1000));
+        fails++;
+      }
+      us += r.us;
+      resent += r.resent;
+      corrupted += r.corrupted;
+    }
+
+    printf("%-14s %5d %9.0f %9.1f %9.1f %9.0f\n", levels[l].name, fails,
+           us / 1000.0 / RUNS, (double)resent / RUNS,
+           (double)corrupted / RUNS, REPLY_LEN * 1e6 * RUNS / us);
+    failed += fails;
+  }
+
+  /* Nothing gets through, so the sender should stop after its retries */
+  LinkConfig dead = {115200, 2000, 0, 0, 1.0};
+  LinkResult r = link_transfer(&dead, 1, reply, REPLY_LEN);
+  uint64_t limit = (LINK_MAX_RETRIES + 2) * LINK_RETRANSMIT_MS * 1000ull;
+  if (r.ok || r.us > limit) {
+    fprintf(stderr, "dead line: gave up after %llu ms\n",
+            (unsigned long long)(r.us / 1000));
+    failed++;
+  }
+
+  if (failed)
+    printf("%d transfers failed\n", failed);
+  return failed != 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * Reply transfer time, compressed and plain
+ *
+ * Sends each reply in replies.h through the chunk window at every rate the
+ * Nspire negotiates, once as plain text and once LZ compressed the way the
+ * ESP32 does it, and prints how long each takes from the first chunk to the
+ * last ACK on a clean line. Encoding and decoding time isn't counted, as the
+ * host says nothing about the ESP32's or the Nspire's.
+ */
+
+#include "link.h"
+#include "replies.h"
+
+#define TURNAROUND_US 2000
+
+static const unsigned bauds[] = {115200, 230400, 460800, 750000};
+
+int main(void) {
+  static uint8_t wire[LZ_ENCODE_BOUND(16384)];
+  static LzEncoder enc;
+  int failed = 0;
+
+  printf("%-7s %6s %6s %8s %9s %9s %7s\n", "reply", "bytes", "as lz", "baud",
+         "plain ms", "lz ms", "speedup");
+  for (unsigned i = 0; i < REPLIES; i++) {
+    int len = strlen(replies[i]);
+
+    lz_encoder_init(&enc);
+    int lz_len = lz_encode(&enc, (const uint8_t *)replies[i], len, wire);
+    lz_len += lz_flush(&enc, wire + lz_len);
+
+    for (unsigned b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++) {
+      LinkConfig cfg = {bauds[b], TURNAROUND_US, 0, 0, 0};
+      LinkResult plain =
+          link_transfer(&cfg, 1, (const uint8_t *)replies[i], len);
+      LinkResult lz = link_transfer(&cfg, 1, wire, lz_len);
+      if (!plain.ok || !lz.ok) {
+        fprintf(stderr, "reply %u at %u baud failed\n", i, bauds[b]);
+        failed++;
+        continue;
+      }
+      printf("%-7u %6d %6d %8u %9.1f %9.1f %6.2fx\n", i, len, lz_len,
+             bauds[b], plain.us / 1000.0, lz.us / 1000.0,
+             (double)plain.us / lz.us);
+    }
+  }
+  return failed != 0;
+}
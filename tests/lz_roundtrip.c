@@ -0,0 +1,114 @@
+/**
+ * LZ codec round trip
+ *
+ * Runs text, random bytes and long repeats through the encoder and decoder
+ * in protocol.h, split the way the link splits them: the encoder is fed in
+ * pieces of any size and flushed at random points, as the ESP32 does with
+ * streamed deltas, and the decoder gets chunks of any size, as they arrive.
+ * Also checks that a decoder with too little room keeps its place. Exits
+ * non-zero on any difference.
+ */
+
+#include "link.h"
+#include "replies.h"
+
+#define INPUT_MAX 16384
+#define RUNS 500
+
+static uint8_t input[INPUT_MAX], wire[LZ_ENCODE_BOUND(INPUT_MAX) * 2];
+static uint8_t output[INPUT_MAX];
+
+static int rand_below(int n) { return sim_rand() % n; }
+
+/* Fill input with one of the kinds of data, returns its length */
+static int make_input(int kind) {
+  int len = 1 + rand_below(INPUT_MAX);
+
+  for (int i = 0, r = 0, at = 0; i < len; i++) {
+    switch (kind) {
+    case 0: /* The replies, over and over */
+      input[i] = replies[r][at++];
+      if (!replies[r][at]) {
+        r = (r + 1) % REPLIES;
+        at = 0;
+      }
+      break;
+    case 1: /* Incompressible */
+      input[i] = sim_rand();
+      break;
+    default: /* Runs longer than a match, and repeats further back than the
+              * window */
+      input[i] = (i / (1 + i % 40)) % 3 ? 'a' + (i / LZ_WINDOW) % 26
+                                        : sim_rand() % 4;
+      break;
+    }
+  }
+  return len;
+}
+
+/* Encode len bytes of input into wire in random pieces with random flushes,
+ * returns the wire length */
+static int encode_split(int len) {
+  static LzEncoder enc;
+  int pos = 0, n = 0;
+
+  lz_encoder_init(&enc);
+  while (pos < len) {
+    int piece = 1 + rand_below(300);
+    if (piece > len - pos)
+      piece = len - pos;
+    n += lz_encode(&enc, input + pos, piece, wire + n);
+    pos += piece;
+    if (rand_below(4) == 0)
+      n += lz_flush(&enc, wire + n);
+  }
+  return n + lz_flush(&enc, wire + n);
+}
+
+/* Decode wire in chunks of random size, with room for out_max bytes */
+static int decode_split(int wire_len, int out_max) {
+  LzDecoder dec;
+  int pos = 0, n = 0;
+
+  lz_decoder_init(&dec);
+  while (pos < wire_len) {
+    int chunk = 1 + rand_below(LINK_CHUNK_SIZE);
+    if (chunk > wire_len - pos)
+      chunk = wire_len - pos;
+    n += lz_decode(&dec, wire + pos, chunk, output + n, out_max - n);
+    pos += chunk;
+  }
+  return n;
+}
+
+int main(void) {
+  static const char *const kinds[] = {"text", "random", "repeats"};
+  int failed = 0;
+
+  sim_rng = 12345;
+  for (int run = 0; run < RUNS; run++) {
+    int kind = run % 3;
+    int len = make_input(kind);
+    int wire_len = encode_split(len);
+
+    if (decode_split(wire_len, INPUT_MAX) != len ||
+        memcmp(output, input, len) != 0) {
+      fprintf(stderr, "%s: run %d, %d bytes, differs\n", kinds[kind], run,
+              len);
+      failed++;
+      continue;
+    }
+
+    /* Short of room, the start still has to come out right */
+    int room = rand_below(len + 1);
+    if (decode_split(wire_len, room) != room ||
+        memcmp(output, input, room) != 0) {
+      fprintf(stderr, "%s: run %d, cut to %d of %d bytes, differs\n",
+              kinds[kind], run, room, len);
+      failed++;
+    }
+  }
+
+  printf("LZ round trip: %d of %d runs failed\n", failed, RUNS);
+  return failed != 0;
+}
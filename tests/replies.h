@@ -0,0 +1,83 @@
+/**
+ * Typical replies, for the LZ tests
+ *
+ * The kind of answer the calculator gets back: explanations with some
+ * markdown, formulas and a little code. Real text matters here, as the
+ * codec's ratio depends on it.
+ */
+
+#ifndef RENSPIRED_TESTS_REPLIES_H
+#define RENSPIRED_TESTS_REPLIES_H
+
+static const char *const replies[] = {
+    /* Short */
+    "The derivative of sin(x^2) is 2x*cos(x^2), by the chain rule: the "
+    "outer function sin(u) differentiates to cos(u), and the inner function "
+    "u = x^2 differentiates to 2x.",
+
+    /* Medium */
+    "To solve the quadratic equation 3x^2 - 5x - 2 = 0, use the quadratic "
+    "formula:\n\n"
+    "x = (-b +/- sqrt(b^2 - 4ac)) / (2a)\n\n"
+    "Here a = 3, b = -5 and c = -2.\n\n"
+    "1. **Discriminant:** b^2 - 4ac = 25 - 4(3)(-2) = 25 + 24 = 49.\n"
+    "2. **Square root:** sqrt(49) = 7.\n"
+    "3. **Roots:** x = (5 + 7) / 6 = 2 and x = (5 - 7) / 6 = -1/3.\n\n"
+    "So the solutions are x = 2 and x = -1/3. You can check either one by "
+    "substituting it back into the equation: 3(2)^2 - 5(2) - 2 = 12 - 10 - 2 "
+    "= 0.\n\n"
+    "The equation also factors as (3x + 1)(x - 2) = 0, which gives the same "
+    "roots. Factoring is quicker when the discriminant is a perfect square, "
+    "as it is here. When it is not, the quadratic formula is the reliable "
+    "way, and on the calculator solve(3x^2-5x-2=0,x) does the same.",
+
+    /* Long */
+    "## Stoichiometry: how much water does burning methane make?\n\n"
+    "Start with the balanced equation for the combustion of methane:\n\n"
+    "CH4 + 2 O2 -> CO2 + 2 H2O\n\n"
+    "The coefficients tell you the mole ratios. One mole of methane reacts "
+    "with two moles of oxygen to produce one mole of carbon dioxide and two "
+    "moles of water.\n\n"
+    "### Step 1: Convert grams of methane to moles\n\n"
+    "The molar mass of CH4 is 12.01 + 4(1.008) = 16.04 g/mol. For 8.00 g of "
+    "methane:\n\n"
+    "moles CH4 = 8.00 g / 16.04 g/mol = 0.499 mol\n\n"
+    "### Step 2: Use the mole ratio\n\n"
+    "The ratio of water to methane is 2 : 1, so:\n\n"
+    "moles H2O = 0.499 mol x 2 = 0.998 mol\n\n"
+    "### Step 3: Convert moles of water to grams\n\n"
+    "The molar mass of H2O is 2(1.008) + 16.00 = 18.02 g/mol:\n\n"
+    "mass H2O = 0.998 mol x 18.02 g/mol = 17.98 g\n\n"
+    "So burning 8.00 g of methane in excess oxygen produces about **18.0 g "
+    "of water**.\n\n"
+    "### Checking the answer\n\n"
+    "Mass is conserved, so the products should weigh the same as the "
+    "reactants. The oxygen used is 0.998 mol x 32.00 g/mol = 31.94 g, and "
+    "the carbon dioxide made is 0.499 mol x 44.01 g/mol = 21.96 g. The "
+    "reactants weigh 8.00 + 31.94 = 39.94 g and the products weigh 21.96 + "
+    "17.98 = 39.94 g, which agree.\n\n"
+    "### Limiting reactant\n\n"
+    "If the oxygen were not in excess, you would first work out which "
+    "reactant runs out. Divide the moles of each reactant by its "
+    "coefficient in the balanced equation; the smallest result is the "
+    "limiting reactant, and every product amount is calculated from it. "
+    "For example, with 0.499 mol of CH4 and only 0.600 mol of O2, the "
+    "ratios are 0.499 / 1 = 0.499 and 0.600 / 2 = 0.300, so oxygen is "
+    "limiting and the water made would be 0.600 mol x (2 / 2) = 0.600 mol, "
+    "or 10.8 g.\n\n"
+    "### On the calculator\n\n"
+    "A small program saves retyping the molar masses:\n\n"
+    "```\n"
+    "Define mm(c,h,o)=c*12.01+h*1.008+o*16.00\n"
+    "Define grams(m,f,t)=m/f*t\n"
+    "grams(8.00,mm(1,4,0),2*mm(0,2,1))\n"
+    "```\n\n"
+    "The last line divides the mass of methane by its molar mass, then "
+    "multiplies by twice the molar mass of water, and gives 17.98. The same "
+    "pattern works for any reaction: convert to moles, apply the ratio from "
+    "the balanced equation, and convert back to grams.",
+};
+
+#define REPLIES (sizeof(replies) / sizeof(replies[0]))
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * Reply throughput against window size
+ *
+ * Times a 16 KB reply through the chunk window at 115200 baud, for a range
+ * of turnaround times: how long the Nspire takes to answer a chunk, which
+ * grows while its main loop is busy painting. The window and chunk size are
+ * fixed when protocol.h is compiled, so make -C tests bench builds this once
+ * per size and each run prints one row. -h prints the header first.
+ */
+
+#include "link.h"
+
+#define REPLY_LEN 16384
+#define NOISY_RUNS 20
+
+static const unsigned turnarounds_us[] = {500, 2000, 10000, 50000};
+#define TURNAROUNDS (sizeof(turnarounds_us) / sizeof(turnarounds_us[0]))
+
+int main(int argc, char **argv) {
+  static uint8_t reply[REPLY_LEN];
+
+  for (int i = 0; i < REPLY_LEN; i++)
+    reply[i] = ' ' + (i * 7 + i / 13) % 95;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0) {
+    printf("bytes/s for a %d byte reply at 115200 baud, by turnaround\n",
+           REPLY_LEN);
+    printf("%-12s", "window");
+    for (unsigned t = 0; t < TURNAROUNDS; t++)
+      printf(" %6.1f ms", turnarounds_us[t] / 1000.0);
+    printf(" %9s\n", "2 ms, 1e-3");
+  }
+
+  printf("%3d x %-6d", LINK_WINDOW, LINK_CHUNK_SIZE);
+  for (unsigned t = 0; t < TURNAROUNDS; t++) {
+    LinkConfig cfg = {115200, turnarounds_us[t], 0, 0, 0};
+    LinkResult r = link_transfer(&cfg, 1, reply, REPLY_LEN);
+    if (!r.ok)
+      printf(" %9s", "failed");
+    else
+      printf(" %9.0f", REPLY_LEN * 1e6 / r.us);
+  }
+
+  /* The same with flipped bits, where a small window stalls on every resend
+   * and a big one keeps the line busy meanwhile */
+  LinkConfig noisy = {115200, 2000, 1e-3, 0, 0};
+  uint64_t us = 0;
+  int failed = 0;
+  for (int run = 0; run < NOISY_RUNS; run++) {
+    LinkResult r =
+        link_transfer(&noisy, 0x9E3779B9u * (run + 1), reply, REPLY_LEN);
+    us += r.us;
+    failed += !r.ok;
+  }
+  if (failed)
+    printf(" %10s\n", "failed");
+  else
+    printf(" %10.0f\n", REPLY_LEN * 1e6 * NOISY_RUNS / us);
+  return failed != 0;
+}